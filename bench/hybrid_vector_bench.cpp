@@ -0,0 +1,216 @@
+/* bench/hybrid_vector_bench.cpp - throughput and latency benchmarks
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+/* Build from the top of the tree with something like
+ *
+ *	g++ -O2 -I. bench/hybrid_vector_bench.cpp -o hybrid_vector_bench \
+ *		-lstxxl -lboost_thread -lboost_chrono -lboost_system -lpthread
+ *
+ * and run it as
+ *
+ *	hybrid_vector_bench [swap_size [lookups]]
+ *
+ * swap_size (default 128 MB) is the spill threshold given to every
+ * hybrid_vector; vectors of a quarter, once and eight times that many bytes
+ * are measured for elements of 4, 16, 64 and 256 bytes. lookups (default
+ * 1 << 16) is the number of random reads per vector.
+ *
+ * One CSV line is written to stdout per measurement:
+ *
+ *	test,container,elem_bytes,elements,seconds,elements_per_second
+ *
+ * container is hybrid, std or stxxl; the last two are the raw containers
+ * hybrid_vector wraps, for judging its overhead. Progress goes to stderr.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <boost/chrono.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <stxxl/vector>
+
+#include <hybrid_vector.h>
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+
+// An element of B bytes
+template <std::size_t B>
+struct elem {
+	uint32_t x[B / 4];
+};
+
+template <std::size_t B>
+elem<B> make_elem(uint64_t i)
+{
+	elem<B> e;
+	for (std::size_t k = 0; k < B / 4; ++k)
+		e.x[k] = uint32_t(i + k);
+	return e;
+}
+
+// Where the checksums go, so that no loop is optimised away
+volatile uint32_t sink;
+
+class stopwatch
+{
+public:
+	stopwatch() :
+			start(clock_type::now()) { }
+	double seconds() const {
+		return boost::chrono::duration<double>(clock_type::now() - start).count();
+	}
+private:
+	clock_type::time_point start;
+};
+
+void report(const char* test, const char* container, std::size_t elem_bytes, uint64_t n,
+            double seconds)
+{
+	std::printf("%s,%s,%u,%llu,%.6f,%.0f\n", test, container, unsigned(elem_bytes),
+			(unsigned long long) n, seconds, seconds > 0 ? n / seconds : 0.0);
+	std::fflush(stdout);
+}
+
+// Opens up the migrations, which are for subclasses
+template <typename T>
+struct migrating_vector : hybrid_vector<T>
+{
+	explicit migrating_vector(uint64_t swap_size) :
+			hybrid_vector<T>(0, swap_size, 1) { }
+	using hybrid_vector<T>::use_ram;
+	using hybrid_vector<T>::use_disk;
+};
+
+template <typename Vector, std::size_t B>
+void bench_push_back(Vector& v, const char* container, uint64_t n)
+{
+	stopwatch w;
+	for (uint64_t i = 0; i < n; ++i)
+		v.push_back(make_elem<B>(i));
+	report("push_back", container, B, n, w.seconds());
+}
+
+template <typename Vector, std::size_t B>
+void bench_scan(const Vector& v, const char* container)
+{
+	uint32_t sum = 0;
+	stopwatch w;
+	for (typename Vector::const_iterator it = v.begin(); it != v.end(); ++it)
+		sum += it->x[0];
+	report("scan", container, B, v.size(), w.seconds());
+	sink = sum;
+}
+
+template <typename Vector, std::size_t B>
+void bench_random(const Vector& v, const char* container, uint64_t lookups)
+{
+	if (v.empty())
+		return;
+	boost::random::mt19937_64 gen(42);
+	boost::random::uniform_int_distribution<uint64_t> pick(0, v.size() - 1);
+	uint32_t sum = 0;
+	stopwatch w;
+	for (uint64_t i = 0; i < lookups; ++i)
+		sum += v[pick(gen)].x[0];
+	report("random_read", container, B, lookups, w.seconds());
+	sink = sum;
+}
+
+template <std::size_t B>
+void bench_size(uint64_t n, uint64_t swap_size, uint64_t lookups)
+{
+	typedef elem<B> T;
+	std::fprintf(stderr, "elem_bytes=%u elements=%llu\n", unsigned(B), (unsigned long long) n);
+
+	std::vector<T> src;
+	src.reserve(n);
+	for (uint64_t i = 0; i < n; ++i)
+		src.push_back(make_elem<B>(i));
+
+	{
+		hybrid_vector<T> h(uint64_t(0), swap_size);
+		bench_push_back<hybrid_vector<T>, B>(h, "hybrid", n);
+		bench_scan<hybrid_vector<T>, B>(h, "hybrid");
+		bench_random<hybrid_vector<T>, B>(h, "hybrid", lookups);
+	}
+	{
+		std::vector<T> s;
+		bench_push_back<std::vector<T>, B>(s, "std", n);
+		bench_scan<std::vector<T>, B>(s, "std");
+		bench_random<std::vector<T>, B>(s, "std", lookups);
+	}
+	{
+		stxxl::vector<T> x;
+		bench_push_back<stxxl::vector<T>, B>(x, "stxxl", n);
+		bench_scan<stxxl::vector<T>, B>(x, "stxxl");
+		bench_random<stxxl::vector<T>, B>(x, "stxxl", lookups);
+	}
+
+	{
+		hybrid_vector<T> h(uint64_t(0), swap_size);
+		stopwatch w;
+		h.append(src.begin(), src.end());
+		report("append", "hybrid", B, n, w.seconds());
+	}
+	{
+		hybrid_vector<T> h(uint64_t(0), swap_size);
+		stopwatch w;
+		h.assign(src.begin(), src.end());
+		report("assign", "hybrid", B, n, w.seconds());
+	}
+	{
+		std::vector<T> s;
+		stopwatch w;
+		s.insert(s.end(), src.begin(), src.end());
+		report("append", "std", B, n, w.seconds());
+	}
+
+	// both migrations of the same elements, whatever the size
+	{
+		migrating_vector<T> h(swap_size);
+		h.append(src.begin(), src.end());
+		stopwatch to_disk;
+		h.use_disk(1);
+		report("migrate_to_disk", "hybrid", B, n, to_disk.seconds());
+		stopwatch to_ram;
+		h.use_ram(1);
+		report("migrate_to_ram", "hybrid", B, n, to_ram.seconds());
+	}
+}
+
+template <std::size_t B>
+void bench_elem(uint64_t swap_size, uint64_t lookups)
+{
+	const uint64_t per_swap = swap_size / B;
+	// below, around and far above the spill threshold
+	bench_size<B>(per_swap / 4, swap_size, lookups);
+	bench_size<B>(per_swap, swap_size, lookups);
+	bench_size<B>(per_swap * 8, swap_size, lookups);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const uint64_t swap_size = argc > 1 ? std::strtoull(argv[1], 0, 0) : 128 << 20;
+	const uint64_t lookups = argc > 2 ? std::strtoull(argv[2], 0, 0) : 1 << 16;
+	std::printf("test,container,elem_bytes,elements,seconds,elements_per_second\n");
+	bench_elem<4>(swap_size, lookups);
+	bench_elem<16>(swap_size, lookups);
+	bench_elem<64>(swap_size, lookups);
+	bench_elem<256>(swap_size, lookups);
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* hybrid_vector/advice.h - access pattern advice for disk containers
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_ADVICE_H
+#define HYBRID_VECTOR_ADVICE_H
+
+#include <hybrid_vector/c99int.h>
+
+// How a range of a hybrid_vector is about to be accessed; see hybrid_vector::advise
+enum hybrid_vector_access {
+	hybrid_vector_normal = 0,
+	hybrid_vector_sequential,	// in increasing order; read ahead
+	hybrid_vector_random,		// no locality; don't read ahead
+	hybrid_vector_willneed,		// soon; start reading it now
+	hybrid_vector_dontneed,		// not for a while; its cache may go
+};
+
+/* Passes advice on to a disk container.
+ * advise() applies @param access to the elements [first, last); prefetch()
+ * starts reading them without waiting for the data.
+ *
+ * The default does nothing: advice and read-ahead take effect only for disk
+ * containers which specialize this, i.e. the mmap backend. With stxxl::vector
+ * a hybrid_vector reads a block when it is touched, whatever the advice.
+ */
+template <typename Vector>
+struct hybrid_vector_advice_traits {
+	static void advise(const Vector&, uint64_t, uint64_t, hybrid_vector_access) { }
+	static void prefetch(const Vector&, uint64_t, uint64_t) { }
+};
+
+#endif
@@ -0,0 +1,398 @@
+/* hybrid_vector/allocator.h - allocators for the ram container
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_ALLOCATOR_H
+#define HYBRID_VECTOR_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <new>
+#include <boost/atomic.hpp>
+#include <boost/config.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+#include <utility>
+#endif
+
+/* The allocator of the default ram container, std::vector<T, type>.
+ * The default is std::allocator; specialize to change it for an element type.
+ */
+template <typename T>
+struct hybrid_vector_default_allocator {
+	typedef std::allocator<T> type;
+};
+
+namespace hybrid_vector_detail {
+
+// What the allocators here have in common; each adds allocate(), deallocate() and rebind
+template <typename T>
+struct allocator_base
+{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	pointer address(reference r) const {
+		return &r;
+	}
+	const_pointer address(const_reference r) const {
+		return &r;
+	}
+
+	size_type max_size() const {
+		return std::numeric_limits<size_type>::max() / sizeof(T);
+	}
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+	template <typename U, typename... Args>
+	void construct(U* p, Args&&... args) {
+		::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+	}
+#else
+	void construct(pointer p, const_reference obj) {
+		::new (static_cast<void*>(p)) T(obj);
+	}
+#endif
+
+	template <typename U>
+	void destroy(U* p) {
+		p->~U();
+	}
+};
+
+inline std::size_t page_size()
+{
+	static const std::size_t page = ::sysconf(_SC_PAGESIZE);
+	return page;
+}
+
+/* A chunk of a thread's arena. live counts the allocations in it, plus one
+ * while it is the chunk its arena carves from; whoever drops it to 0 frees it.
+ * Allocations are preceded by a pointer to their chunk, in a header of
+ * arena_align bytes.
+ */
+enum { arena_align = 16 };
+
+struct arena_chunk
+{
+	boost::atomic<std::size_t> live;
+	std::size_t bytes;
+
+	// The bytes before the first allocation
+	static std::size_t overhead() {
+		return (sizeof(arena_chunk) + arena_align - 1) / arena_align * arena_align;
+	}
+
+	char* begin() {
+		return reinterpret_cast<char*>(this) + overhead();
+	}
+	char* end() {
+		return reinterpret_cast<char*>(this) + bytes;
+	}
+
+	static arena_chunk* create(std::size_t bytes, std::size_t live) {
+		void* p = std::malloc(bytes);
+		if (!p)
+			throw std::bad_alloc();
+		arena_chunk* c = static_cast<arena_chunk*>(p);
+		c->live = live;
+		c->bytes = bytes;
+		return c;
+	}
+
+	void release() {
+		if (live.fetch_sub(1, boost::memory_order_acq_rel) == 1)
+			std::free(this);
+	}
+};
+
+// The chunks a thread allocates from; each thread has one
+class arena : boost::noncopyable
+{
+public:
+	enum { chunk_bytes = 1 << 20 };
+
+	arena() :
+			current(0), next(0) { }
+
+	~arena() {
+		if (current)
+			current->release();
+	}
+
+	static arena& local() {
+		static boost::once_flag once = BOOST_ONCE_INIT;
+		boost::call_once(&init_local, once);
+		boost::thread_specific_ptr<arena>& p = *local_instance();
+		if (!p.get())
+			p.reset(new arena);
+		return *p;
+	}
+
+	void* allocate(std::size_t bytes) {
+		const std::size_t need = arena_align + (bytes + arena_align - 1) / arena_align * arena_align;
+		// a large block gets a chunk of its own, freed with it
+		if (need > chunk_bytes / 4) {
+			arena_chunk* c = arena_chunk::create(arena_chunk::overhead() + need, 1);
+			return carve(c, c->begin());
+		}
+		if (!current || next + need > current->end()) {
+			// every allocation in it is gone: start over
+			if (current && current->live.load(boost::memory_order_acquire) == 1) {
+				next = current->begin();
+			} else {
+				if (current)
+					current->release();
+				// gone, even if no other chunk can be had
+				current = 0;
+				current = arena_chunk::create(chunk_bytes, 1);
+				next = current->begin();
+			}
+		}
+		current->live.fetch_add(1, boost::memory_order_relaxed);
+		char* p = next;
+		next += need;
+		return carve(current, p);
+	}
+
+	// From any thread
+	static void deallocate(void* p) {
+		(*reinterpret_cast<arena_chunk**>(static_cast<char*>(p) - arena_align))->release();
+	}
+
+private:
+	static void* carve(arena_chunk* c, char* p) {
+		*reinterpret_cast<arena_chunk**>(p) = c;
+		return p + arena_align;
+	}
+
+	static boost::thread_specific_ptr<arena>*& local_instance() {
+		static boost::thread_specific_ptr<arena>* p = 0;
+		return p;
+	}
+	static void init_local() {
+		// never destroyed: threads may outlive static destruction
+		local_instance() = new boost::thread_specific_ptr<arena>;
+	}
+
+	arena_chunk* current;
+	char* next;
+};
+
+} // namespace hybrid_vector_detail
+
+/* Allocates from a chunk of memory of the allocating thread, by moving a
+ * pointer, and frees a chunk when the last block in it is freed. Suits many
+ * short-lived vectors, which then neither fragment the heap nor take its
+ * locks. A block may be freed on any thread. Memory held by a long-lived
+ * block keeps its whole chunk alive, so vectors that outlive their
+ * neighbours are better off elsewhere; blocks over a quarter of a chunk
+ * get a chunk of their own.
+ */
+template <typename T>
+class hybrid_vector_arena_allocator : public hybrid_vector_detail::allocator_base<T>
+{
+	BOOST_STATIC_ASSERT(boost::alignment_of<T>::value <= hybrid_vector_detail::arena_align);
+public:
+	typedef typename hybrid_vector_detail::allocator_base<T>::pointer pointer;
+	typedef typename hybrid_vector_detail::allocator_base<T>::size_type size_type;
+
+	template <typename U>
+	struct rebind {
+		typedef hybrid_vector_arena_allocator<U> other;
+	};
+
+	hybrid_vector_arena_allocator() { }
+	template <typename U>
+	hybrid_vector_arena_allocator(const hybrid_vector_arena_allocator<U>&) { }
+
+	pointer allocate(size_type n, const void* = 0) {
+		if (n > this->max_size())
+			throw std::bad_alloc();
+		return static_cast<pointer>(hybrid_vector_detail::arena::local().allocate(n * sizeof(T)));
+	}
+
+	void deallocate(pointer p, size_type) {
+		hybrid_vector_detail::arena::deallocate(p);
+	}
+};
+
+template <typename T, typename U>
+bool operator == (const hybrid_vector_arena_allocator<T>&, const hybrid_vector_arena_allocator<U>&)
+{
+	return 1;
+}
+
+template <typename T, typename U>
+bool operator != (const hybrid_vector_arena_allocator<T>&, const hybrid_vector_arena_allocator<U>&)
+{
+	return 0;
+}
+
+/* Puts blocks of at least huge_page_bytes in huge pages, for large vectors
+ * which stay in ram: one TLB entry then covers 2 MB of them. It asks for
+ * reserved huge pages (MAP_HUGETLB) first, then for ordinary pages the
+ * kernel may back with transparent huge pages. Smaller blocks come from
+ * operator new.
+ */
+template <typename T>
+class hybrid_vector_huge_page_allocator : public hybrid_vector_detail::allocator_base<T>
+{
+public:
+	typedef typename hybrid_vector_detail::allocator_base<T>::pointer pointer;
+	typedef typename hybrid_vector_detail::allocator_base<T>::size_type size_type;
+
+	// The huge page size of x86-64 and most others
+	static const std::size_t huge_page_bytes = std::size_t(2) << 20;
+
+	template <typename U>
+	struct rebind {
+		typedef hybrid_vector_huge_page_allocator<U> other;
+	};
+
+	hybrid_vector_huge_page_allocator() { }
+	template <typename U>
+	hybrid_vector_huge_page_allocator(const hybrid_vector_huge_page_allocator<U>&) { }
+
+	pointer allocate(size_type n, const void* = 0) {
+		if (n > this->max_size())
+			throw std::bad_alloc();
+		const std::size_t bytes = n * sizeof(T);
+		if (bytes < huge_page_bytes)
+			return static_cast<pointer>(::operator new(bytes));
+		const std::size_t len = mapped_bytes(bytes);
+		void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		p = ::mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (p == MAP_FAILED) {
+			p = ::mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+			::madvise(p, len, MADV_HUGEPAGE);
+#endif
+		}
+		return static_cast<pointer>(p);
+	}
+
+	void deallocate(pointer p, size_type n) {
+		const std::size_t bytes = n * sizeof(T);
+		if (bytes < huge_page_bytes)
+			::operator delete(p);
+		else
+			::munmap(p, mapped_bytes(bytes));
+	}
+
+private:
+	static std::size_t mapped_bytes(std::size_t bytes) {
+		return (bytes + huge_page_bytes - 1) / huge_page_bytes * huge_page_bytes;
+	}
+};
+
+template <typename T, typename U>
+bool operator == (const hybrid_vector_huge_page_allocator<T>&, const hybrid_vector_huge_page_allocator<U>&)
+{
+	return 1;
+}
+
+template <typename T, typename U>
+bool operator != (const hybrid_vector_huge_page_allocator<T>&, const hybrid_vector_huge_page_allocator<U>&)
+{
+	return 0;
+}
+
+/* Gets blocks from Base and faults in their pages before handing them out,
+ * so the page faults of a large vector are taken in one go when it grows
+ * rather than one by one as it is first written. The kernel populates the
+ * pages where it can (MADV_POPULATE_WRITE); otherwise each page is written.
+ */
+template <typename T, typename Base = std::allocator<T> >
+class hybrid_vector_prefault_allocator : public hybrid_vector_detail::allocator_base<T>
+{
+	template <typename, typename>
+	friend class hybrid_vector_prefault_allocator;
+public:
+	typedef typename hybrid_vector_detail::allocator_base<T>::pointer pointer;
+	typedef typename hybrid_vector_detail::allocator_base<T>::size_type size_type;
+
+	template <typename U>
+	struct rebind {
+#ifndef BOOST_NO_CXX11_ALLOCATOR
+		// std::allocator has no rebind of its own from C++20 on
+		typedef hybrid_vector_prefault_allocator<U,
+				typename std::allocator_traits<Base>::template rebind_alloc<U> > other;
+#else
+		typedef hybrid_vector_prefault_allocator<U, typename Base::template rebind<U>::other> other;
+#endif
+	};
+
+	hybrid_vector_prefault_allocator() { }
+	explicit hybrid_vector_prefault_allocator(const Base& base_) :
+			base(base_) { }
+	template <typename U, typename B>
+	hybrid_vector_prefault_allocator(const hybrid_vector_prefault_allocator<U, B>& a) :
+			base(a.base) { }
+
+	pointer allocate(size_type n, const void* = 0) {
+		pointer p = base.allocate(n);
+		const std::size_t page = hybrid_vector_detail::page_size();
+		char* first = reinterpret_cast<char*>(p);
+		char* last = first + n * sizeof(T);
+		// whole pages only; the partial ones at the ends are small and
+		// may be shared with other blocks
+		char* lo = reinterpret_cast<char*>((reinterpret_cast<std::size_t>(first) + page - 1) / page * page);
+		if (lo >= last)
+			return p;
+#ifdef MADV_POPULATE_WRITE
+		if (::madvise(lo, (last - lo) / page * page, MADV_POPULATE_WRITE) == 0)
+			return p;
+#endif
+		for (volatile char* q = lo; q < last; q += page)
+			*q = 0;
+		return p;
+	}
+
+	void deallocate(pointer p, size_type n) {
+		base.deallocate(p, n);
+	}
+
+	template <typename U, typename B>
+	bool operator == (const hybrid_vector_prefault_allocator<U, B>& a) const {
+		return base == a.base;
+	}
+	template <typename U, typename B>
+	bool operator != (const hybrid_vector_prefault_allocator<U, B>& a) const {
+		return !(base == a.base);
+	}
+
+private:
+	Base base;
+};
+
+#endif
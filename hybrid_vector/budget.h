@@ -0,0 +1,236 @@
+/* hybrid_vector/budget.h - memory budget shared between hybrid_vectors
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_BUDGET_H
+#define HYBRID_VECTOR_BUDGET_H
+
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+#include <hybrid_vector/c99int.h>
+
+class hybrid_vector_budget;
+
+/* The part of a hybrid_vector its budget knows about.
+ * resident, last_use and the links of the budget's list of clients are
+ * guarded by the budget's mutex; evict is set by the budget and acted upon
+ * by the owner at its next size change.
+ */
+class hybrid_vector_budget_client
+{
+	friend class hybrid_vector_budget;
+protected:
+	hybrid_vector_budget* budget;
+	uint64_t resident;
+	uint64_t last_use;
+	uint64_t seen_generation;
+	boost::atomic<bool> evict;
+	hybrid_vector_budget_client* prev;
+	hybrid_vector_budget_client* next;
+
+	hybrid_vector_budget_client() :
+			budget(0), resident(0), last_use(0), seen_generation(0), evict(0), prev(0), next(0) { }
+	// registration belongs to an object, not to its value
+	hybrid_vector_budget_client(const hybrid_vector_budget_client&) :
+			budget(0), resident(0), last_use(0), seen_generation(0), evict(0), prev(0), next(0) { }
+	hybrid_vector_budget_client& operator = (const hybrid_vector_budget_client&) {
+		return *this;
+	}
+	~hybrid_vector_budget_client() { }
+};
+
+/* Caps the ram used by every hybrid_vector attached to it.
+ *
+ * Vectors report the bytes they hold in ram as they grow. When a report would
+ * take the total over the limit, the least recently active vectors (largest
+ * first among equals) are asked to spill until enough would be freed; they do
+ * so at their next size change, so the limit is soft in between. If no such
+ * set exists, the reporting vector is refused and spills itself.
+ * A spilled vector is let back into ram only when the total has room for it.
+ */
+class hybrid_vector_budget : boost::noncopyable
+{
+	typedef hybrid_vector_budget_client client;
+public:
+	explicit hybrid_vector_budget(uint64_t limit_ = uint64_t(-1)) :
+			limit(limit_), total(0), clock(0), generation(0), clients(0) { }
+
+	~hybrid_vector_budget() {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		for (client* c = clients; c; c = c->next)
+			c->budget = 0;
+	}
+
+	// The process-wide budget; unlimited until set_limit() is called
+	static hybrid_vector_budget& global() {
+		static boost::once_flag once = BOOST_ONCE_INIT;
+		boost::call_once(&init_global, once);
+		return *global_instance();
+	}
+
+	uint64_t get_limit() const {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		return limit;
+	}
+	void set_limit(uint64_t limit_) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		limit = limit_;
+		++generation;
+	}
+
+	// Bytes currently held in ram by all attached vectors
+	uint64_t resident() const {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		return total;
+	}
+
+	// Bumped whenever room may have been freed
+	uint64_t get_generation() const {
+		return generation;
+	}
+
+	void attach(client* c) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		c->prev = 0;
+		c->next = clients;
+		if (clients)
+			clients->prev = c;
+		clients = c;
+		c->budget = this;
+		c->resident = 0;
+		c->last_use = ++clock;
+		c->seen_generation = generation;
+		c->evict = 0;
+	}
+
+	void detach(client* c) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (c->prev)
+			c->prev->next = c->next;
+		else
+			clients = c->next;
+		if (c->next)
+			c->next->prev = c->prev;
+		total -= c->resident;
+		c->budget = 0;
+		c->resident = 0;
+		++generation;
+	}
+
+	// Moves the registration of @param from, with the bytes it holds, to
+	// @param to; allocates nothing, so a move constructor may do it
+	void hand_over(client* from, client* to) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		to->prev = from->prev;
+		to->next = from->next;
+		if (to->prev)
+			to->prev->next = to;
+		else
+			clients = to;
+		if (to->next)
+			to->next->prev = to;
+		to->budget = this;
+		to->resident = from->resident;
+		to->last_use = from->last_use;
+		to->seen_generation = from->seen_generation;
+		to->evict = bool(from->evict);
+		from->budget = 0;
+		from->resident = 0;
+		from->evict = 0;
+	}
+
+	/* Asks for @param c to hold @param bytes in ram.
+	 * If @param make_room is set, colder vectors may be asked to spill to make
+	 * that possible. Returns whether the request was granted.
+	 */
+	bool admit(client* c, uint64_t bytes, bool make_room) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		c->last_use = ++clock;
+		c->seen_generation = generation;
+		uint64_t others = total - c->resident;
+		if (others + bytes > limit) {
+			if (!make_room || !evict_for(c, others + bytes - limit))
+				return 0;
+		}
+		total = others + bytes;
+		c->resident = bytes;
+		return 1;
+	}
+
+	// Records that @param c now holds @param bytes in ram, unconditionally
+	void update(client* c, uint64_t bytes) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if (bytes < c->resident)
+			++generation;
+		total = total - c->resident + bytes;
+		c->resident = bytes;
+		c->last_use = ++clock;
+		c->seen_generation = generation;
+	}
+
+private:
+	struct colder {
+		bool operator () (const client* a, const client* b) const {
+			if (a->last_use != b->last_use)
+				return a->last_use < b->last_use;
+			return a->resident > b->resident;
+		}
+	};
+
+	// Flags the coldest clients other than @param c until @param need bytes
+	// would be freed. Flags nothing and returns false if that is impossible.
+	bool evict_for(client* c, uint64_t need) {
+		std::vector<client*> candidates;
+		uint64_t avail = 0;
+		for (client* it = clients; it; it = it->next) {
+			if (it != c && it->resident && !it->evict) {
+				candidates.push_back(it);
+				avail += it->resident;
+			}
+		}
+		if (avail < need)
+			return 0;
+		std::sort(candidates.begin(), candidates.end(), colder());
+		uint64_t freed = 0;
+		for (std::vector<client*>::iterator it = candidates.begin(); freed < need; ++it) {
+			(*it)->evict = 1;
+			freed += (*it)->resident;
+		}
+		return 1;
+	}
+
+	static hybrid_vector_budget*& global_instance() {
+		static hybrid_vector_budget* p = 0;
+		return p;
+	}
+	static void init_global() {
+		// never destroyed: vectors with static storage may outlive it otherwise
+		global_instance() = new hybrid_vector_budget;
+	}
+
+	mutable boost::mutex mutex;
+	uint64_t limit;
+	uint64_t total;
+	uint64_t clock;
+	boost::atomic<uint64_t> generation;
+	// the attached clients, linked through their prev and next
+	client* clients;
+};
+
+#endif
@@ -0,0 +1,275 @@
+/* hybrid_vector/bulk_io.h - raw element import and export
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_BULK_IO_H
+#define HYBRID_VECTOR_BULK_IO_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <boost/current_function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <hybrid_vector/c99int.h>
+
+/* How hybrid_vector::import_from and export_to move elements between a disk
+ * container and a file descriptor without copying them through a buffer.
+ * append() adds @param count elements read from @param fd at its offset;
+ * write() writes the elements [first, last) to @param fd at its offset.
+ * Both return 0 without doing anything if Vector cannot do it, as with the
+ * default; the elements then go through buffers.
+ */
+template <typename Vector>
+struct hybrid_vector_fd_traits {
+	static bool append(Vector&, int, uint64_t) {
+		return 0;
+	}
+	static bool write(const Vector&, uint64_t, uint64_t, int) {
+		return 0;
+	}
+};
+
+namespace hybrid_vector_detail {
+
+inline void io_error(const char* func, const char* what)
+{
+	throw std::runtime_error(func + std::string(": ") + what + ": " + std::strerror(errno));
+}
+
+inline void io_truncated(const char* func)
+{
+	throw std::runtime_error(func + std::string(": input is truncated"));
+}
+
+// Fills [p, p + bytes) from @param fd, throwing if the input ends first
+inline void read_fully(int fd, char* p, std::size_t bytes)
+{
+	while (bytes) {
+		ssize_t k = ::read(fd, p, bytes);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0)
+			io_error(BOOST_CURRENT_FUNCTION, "read");
+		if (!k)
+			io_truncated(BOOST_CURRENT_FUNCTION);
+		p += k;
+		bytes -= k;
+	}
+}
+
+inline void write_fully(int fd, const char* p, std::size_t bytes)
+{
+	while (bytes) {
+		ssize_t k = ::write(fd, p, bytes);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0)
+			io_error(BOOST_CURRENT_FUNCTION, "write");
+		p += k;
+		bytes -= k;
+	}
+}
+
+/* Where import_from() reads: read() fills a range or throws, and append_to()
+ * tries hybrid_vector_fd_traits. Sinks are the same for export_to().
+ */
+struct fd_source
+{
+	int fd;
+
+	explicit fd_source(int fd_) :
+			fd(fd_) { }
+
+	void read(char* p, std::size_t bytes) {
+		read_fully(fd, p, bytes);
+	}
+	template <typename Vector>
+	bool append_to(Vector& v, uint64_t count) {
+		return hybrid_vector_fd_traits<Vector>::append(v, fd, count);
+	}
+};
+
+struct stream_source
+{
+	std::istream* is;
+
+	explicit stream_source(std::istream& is_) :
+			is(&is_) { }
+
+	void read(char* p, std::size_t bytes) {
+		is->read(p, bytes);
+		if (!*is)
+			io_truncated(BOOST_CURRENT_FUNCTION);
+	}
+	template <typename Vector>
+	bool append_to(Vector&, uint64_t) {
+		return 0;
+	}
+};
+
+struct fd_sink
+{
+	int fd;
+
+	explicit fd_sink(int fd_) :
+			fd(fd_) { }
+
+	void write(const char* p, std::size_t bytes) {
+		write_fully(fd, p, bytes);
+	}
+	template <typename Vector>
+	bool write_from(const Vector& v, uint64_t first, uint64_t last) {
+		return hybrid_vector_fd_traits<Vector>::write(v, first, last, fd);
+	}
+};
+
+struct stream_sink
+{
+	std::ostream* os;
+
+	explicit stream_sink(std::ostream& os_) :
+			os(&os_) { }
+
+	void write(const char* p, std::size_t bytes) {
+		os->write(p, bytes);
+		if (!*os)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": cannot write"));
+	}
+	template <typename Vector>
+	bool write_from(const Vector&, uint64_t, uint64_t) {
+		return 0;
+	}
+};
+
+// Segment visitors reading the elements from a source, and writing them to a sink
+template <typename Source>
+struct segment_importer
+{
+	Source* src;
+
+	explicit segment_importer(Source& src_) :
+			src(&src_) { }
+
+	template <typename T>
+	void operator () (T* first, T* last) {
+		src->read(reinterpret_cast<char*>(first), (last - first) * sizeof(T));
+	}
+};
+
+template <typename Sink>
+struct segment_exporter
+{
+	Sink* sink;
+
+	explicit segment_exporter(Sink& sink_) :
+			sink(&sink_) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		sink->write(reinterpret_cast<const char*>(first), (last - first) * sizeof(T));
+	}
+};
+
+// Segment visitor copying the elements to successive places from out on
+template <typename T>
+struct segment_gatherer
+{
+	T* out;
+
+	explicit segment_gatherer(T* out_) :
+			out(out_) { }
+
+	void operator () (const T* first, const T* last) {
+		out = std::copy(first, last, out);
+	}
+};
+
+// The reverse: fills each segment from successive places from in on
+template <typename T>
+struct segment_scatterer
+{
+	const T* in;
+
+	explicit segment_scatterer(const T* in_) :
+			in(in_) { }
+
+	void operator () (T* first, T* last) {
+		std::copy(in, in + (last - first), first);
+		in += last - first;
+	}
+};
+
+// Pool tasks moving one buffer in or out while the caller works on the other
+template <typename Source>
+struct read_task
+{
+	Source* src;
+	char* p;
+	std::size_t bytes;
+
+	void operator () (uint64_t) const {
+		src->read(p, bytes);
+	}
+};
+
+template <typename Sink>
+struct write_task
+{
+	Sink* sink;
+	const char* p;
+	std::size_t bytes;
+
+	void operator () (uint64_t) const {
+		sink->write(p, bytes);
+	}
+};
+
+// A page-aligned buffer of @param n T, for I/O the kernel can do in whole pages
+template <typename T>
+class io_buffer : boost::noncopyable
+{
+public:
+	explicit io_buffer(std::size_t n) :
+			p(0) {
+		void* q;
+		if (::posix_memalign(&q, ::sysconf(_SC_PAGESIZE), n * sizeof(T)) != 0)
+			throw std::bad_alloc();
+		p = static_cast<T*>(q);
+	}
+
+	~io_buffer() {
+		std::free(p);
+	}
+
+	T* get() const {
+		return p;
+	}
+
+private:
+	T* p;
+};
+
+} // namespace hybrid_vector_detail
+
+#endif
@@ -0,0 +1,748 @@
+/* hybrid_vector/compressed_vector.h - block-compressed file vector
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_COMPRESSED_VECTOR_H
+#define HYBRID_VECTOR_COMPRESSED_VECTOR_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/assert.hpp>
+#include <boost/current_function.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/conditional.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+#include <boost/type_traits/is_integral.hpp>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <hybrid_vector/c99int.h>
+#include <hybrid_vector/segment.h>
+
+/* Block codecs for hybrid_vector_compressed_vector.
+ * encode() appends an encoding of the elements [first, last) to @param out;
+ * decode() turns the @param bytes bytes at @param in back into the @param n
+ * elements at @param out, and throws if they do not hold exactly that many.
+ * Each block is encoded on its own, so a codec may adapt to it.
+ */
+
+namespace hybrid_vector_detail {
+
+inline void corrupt_block(const char* func)
+{
+	throw std::runtime_error(func + std::string(": corrupt block"));
+}
+
+inline void put_varint(std::vector<char>& out, uint64_t x)
+{
+	for (; x >= 0x80; x >>= 7)
+		out.push_back(char(x | 0x80));
+	out.push_back(char(x));
+}
+
+inline unsigned varint_bytes(uint64_t x)
+{
+	unsigned k = 1;
+	for (; x >= 0x80; x >>= 7)
+		++k;
+	return k;
+}
+
+// Reads a varint from [in, end), advancing @param in past it
+inline uint64_t get_varint(const unsigned char*& in, const unsigned char* end)
+{
+	uint64_t x = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (in == end)
+			break;
+		unsigned char c = *in++;
+		x |= uint64_t(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return x;
+	}
+	corrupt_block(BOOST_CURRENT_FUNCTION);
+	return 0;
+}
+
+// Maps differences of either sign to small unsigned numbers: 0, -1, 1, -2, ...
+inline uint64_t zigzag(uint64_t x)
+{
+	return (x << 1) ^ (0 - (x >> 63));
+}
+inline uint64_t unzigzag(uint64_t x)
+{
+	return (x >> 1) ^ (0 - (x & 1));
+}
+
+inline void put_bytes(std::vector<char>& out, const void* p, std::size_t bytes)
+{
+	const char* c = static_cast<const char*>(p);
+	out.insert(out.end(), c, c + bytes);
+}
+
+// Copies exactly @param bytes bytes from [in, end) to @param out
+inline void get_bytes(const unsigned char* in, const unsigned char* end, void* out, std::size_t bytes)
+{
+	if (std::size_t(end - in) != bytes)
+		corrupt_block(BOOST_CURRENT_FUNCTION);
+	std::memcpy(out, in, bytes);
+}
+
+} // namespace hybrid_vector_detail
+
+/* For integral T: the block is stored as varints, either of the differences
+ * between neighbours (zigzag-coded, so that small steps either way stay
+ * short) or of the offsets from the block's minimum, whichever is shorter;
+ * verbatim if neither is shorter than that. Suits sorted ids and counters
+ * with a small range.
+ */
+template <typename T>
+struct hybrid_vector_integer_codec {
+	BOOST_STATIC_ASSERT(boost::is_integral<T>::value);
+	enum { verbatim = 0, delta = 1, frame_of_reference = 2 };
+
+	static void encode(const T* first, const T* last, std::vector<char>& out) {
+		using namespace hybrid_vector_detail;
+		if (first == last)
+			return;
+		const uint64_t lo = uint64_t(*std::min_element(first, last));
+		uint64_t delta_bytes = 0;
+		uint64_t for_bytes = varint_bytes(lo);
+		uint64_t prev = 0;
+		for (const T* p = first; p != last; ++p) {
+			delta_bytes += varint_bytes(zigzag(uint64_t(*p) - prev));
+			for_bytes += varint_bytes(uint64_t(*p) - lo);
+			prev = uint64_t(*p);
+		}
+		if (std::min(delta_bytes, for_bytes) >= uint64_t(last - first) * sizeof(T)) {
+			out.push_back(char(verbatim));
+			put_bytes(out, first, (last - first) * sizeof(T));
+		} else if (delta_bytes <= for_bytes) {
+			out.push_back(char(delta));
+			prev = 0;
+			for (const T* p = first; p != last; ++p) {
+				put_varint(out, zigzag(uint64_t(*p) - prev));
+				prev = uint64_t(*p);
+			}
+		} else {
+			out.push_back(char(frame_of_reference));
+			put_varint(out, lo);
+			for (const T* p = first; p != last; ++p)
+				put_varint(out, uint64_t(*p) - lo);
+		}
+	}
+
+	static void decode(const char* in_, std::size_t bytes, T* out, std::size_t n) {
+		using namespace hybrid_vector_detail;
+		const unsigned char* in = reinterpret_cast<const unsigned char*>(in_);
+		const unsigned char* end = in + bytes;
+		if (!n || in == end) {
+			if (n || bytes)
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			return;
+		}
+		switch (*in++) {
+		case verbatim:
+			get_bytes(in, end, out, n * sizeof(T));
+			return;
+		case delta: {
+			uint64_t prev = 0;
+			for (std::size_t i = 0; i < n; ++i) {
+				prev += unzigzag(get_varint(in, end));
+				out[i] = T(prev);
+			}
+			break;
+		}
+		case frame_of_reference: {
+			const uint64_t lo = get_varint(in, end);
+			for (std::size_t i = 0; i < n; ++i)
+				out[i] = T(lo + get_varint(in, end));
+			break;
+		}
+		default:
+			corrupt_block(BOOST_CURRENT_FUNCTION);
+		}
+		if (in != end)
+			corrupt_block(BOOST_CURRENT_FUNCTION);
+	}
+};
+
+/* For any trivially copyable T: an LZ77 coder over the bytes of the block,
+ * in the manner of LZ4, which gives up some ratio for speed. A run of at
+ * least min_match bytes seen in the previous 64 KB becomes an offset and a
+ * length; verbatim if that saves nothing.
+ *
+ * Each sequence is a token (literal count << 4 | match length - min_match,
+ * with 15 meaning more follows in bytes of 255 and a last one under 255),
+ * the literals, and unless the block ends there, a 16-bit little-endian
+ * offset and the rest of the match length.
+ */
+template <typename T>
+struct hybrid_vector_lz_codec {
+	enum { verbatim = 0, lz = 1 };
+	enum { hash_bits = 12, min_match = 4, max_offset = 0xffff };
+
+	static void encode(const T* first, const T* last, std::vector<char>& out) {
+		using namespace hybrid_vector_detail;
+		if (first == last)
+			return;
+		const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+		const std::size_t n = (last - first) * sizeof(T);
+		const std::size_t start = out.size();
+		out.push_back(char(lz));
+		// where each hash was last seen, plus one; 0 if never
+		std::size_t table[1 << hash_bits] = { 0 };
+		std::size_t lit = 0;
+		for (std::size_t i = 0; i + min_match <= n; ) {
+			const uint32_t word = load32(src + i);
+			std::size_t& seen = table[hash(word)];
+			const std::size_t cand = seen;
+			seen = i + 1;
+			if (!cand || i + 1 - cand > max_offset || load32(src + cand - 1) != word) {
+				++i;
+				continue;
+			}
+			std::size_t len = min_match;
+			while (i + len < n && src[cand - 1 + len] == src[i + len])
+				++len;
+			put_sequence(out, src + lit, i - lit, i + 1 - cand, len);
+			i += len;
+			lit = i;
+		}
+		put_sequence(out, src + lit, n - lit, 0, 0);
+		if (out.size() - start > n) {
+			out.resize(start);
+			out.push_back(char(verbatim));
+			put_bytes(out, src, n);
+		}
+	}
+
+	static void decode(const char* in_, std::size_t bytes, T* out_, std::size_t n) {
+		using namespace hybrid_vector_detail;
+		const unsigned char* in = reinterpret_cast<const unsigned char*>(in_);
+		const unsigned char* end = in + bytes;
+		unsigned char* const out = reinterpret_cast<unsigned char*>(out_);
+		unsigned char* const out_end = out + n * sizeof(T);
+		if (!n || in == end) {
+			if (n || bytes)
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			return;
+		}
+		switch (*in++) {
+		case verbatim:
+			get_bytes(in, end, out, n * sizeof(T));
+			return;
+		case lz:
+			break;
+		default:
+			corrupt_block(BOOST_CURRENT_FUNCTION);
+		}
+		unsigned char* dst = out;
+		for (;;) {
+			if (in == end)
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			const unsigned token = *in++;
+			std::size_t lit = token >> 4;
+			if (lit == 15)
+				lit += get_length(in, end);
+			if (lit > std::size_t(end - in) || lit > std::size_t(out_end - dst))
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			std::memcpy(dst, in, lit);
+			dst += lit;
+			in += lit;
+			if (in == end)
+				break;
+			if (end - in < 2)
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			const std::size_t offset = in[0] | in[1] << 8;
+			in += 2;
+			std::size_t len = (token & 15) + min_match;
+			if ((token & 15) == 15)
+				len += get_length(in, end);
+			if (!offset || offset > std::size_t(dst - out) || len > std::size_t(out_end - dst))
+				corrupt_block(BOOST_CURRENT_FUNCTION);
+			// the match may overlap what it produces
+			const unsigned char* from = dst - offset;
+			for (std::size_t k = 0; k < len; ++k)
+				dst[k] = from[k];
+			dst += len;
+		}
+		if (dst != out_end)
+			corrupt_block(BOOST_CURRENT_FUNCTION);
+	}
+
+private:
+	static uint32_t load32(const unsigned char* p) {
+		uint32_t x;
+		std::memcpy(&x, p, sizeof(x));
+		return x;
+	}
+
+	static std::size_t hash(uint32_t word) {
+		return (word * 2654435761u) >> (32 - hash_bits);
+	}
+
+	static void put_length(std::vector<char>& out, std::size_t x) {
+		for (; x >= 255; x -= 255)
+			out.push_back(char(255));
+		out.push_back(char(x));
+	}
+
+	static std::size_t get_length(const unsigned char*& in, const unsigned char* end) {
+		std::size_t x = 0;
+		for (;;) {
+			if (in == end)
+				hybrid_vector_detail::corrupt_block(BOOST_CURRENT_FUNCTION);
+			const unsigned char c = *in++;
+			x += c;
+			if (c != 255)
+				return x;
+		}
+	}
+
+	// @param len is 0 for the literals which end the block
+	static void put_sequence(std::vector<char>& out, const unsigned char* lit, std::size_t lit_len,
+	                         std::size_t offset, std::size_t len) {
+		const std::size_t extra = len ? len - min_match : 0;
+		out.push_back(char(std::min<std::size_t>(lit_len, 15) << 4 | std::min<std::size_t>(extra, 15)));
+		if (lit_len >= 15)
+			put_length(out, lit_len - 15);
+		hybrid_vector_detail::put_bytes(out, lit, lit_len);
+		if (!len)
+			return;
+		out.push_back(char(offset & 0xff));
+		out.push_back(char(offset >> 8));
+		if (extra >= 15)
+			put_length(out, extra - 15);
+	}
+};
+
+// The codec hybrid_vector_compressed_vector<T> uses unless told otherwise
+template <typename T>
+struct hybrid_vector_default_codec {
+	typedef typename boost::conditional<boost::is_integral<T>::value,
+			hybrid_vector_integer_codec<T>, hybrid_vector_lz_codec<T> >::type type;
+};
+
+// Iterator of hybrid_vector_compressed_vector; each dereference is a lookup
+template <typename Vector, typename Value>
+class hybrid_vector_compressed_iterator : public boost::iterator_facade<
+		hybrid_vector_compressed_iterator<Vector, Value>, Value,
+		boost::random_access_traversal_tag, Value&, int64_t>
+{
+	friend class boost::iterator_core_access;
+	template <typename, typename>
+	friend class hybrid_vector_compressed_iterator;
+public:
+	hybrid_vector_compressed_iterator() :
+			v(0), i(0) { }
+	hybrid_vector_compressed_iterator(Vector* v_, uint64_t i_) :
+			v(v_), i(i_) { }
+	// iterator -> const_iterator
+	template <typename V, typename U>
+	hybrid_vector_compressed_iterator(const hybrid_vector_compressed_iterator<V, U>& it) :
+			v(it.v), i(it.i) { }
+
+private:
+	Value& dereference() const {
+		return (*v)[i];
+	}
+	template <typename V, typename U>
+	bool equal(const hybrid_vector_compressed_iterator<V, U>& it) const {
+		return i == it.i;
+	}
+	void increment() {
+		++i;
+	}
+	void decrement() {
+		--i;
+	}
+	void advance(int64_t n) {
+		i += n;
+	}
+	template <typename V, typename U>
+	int64_t distance_to(const hybrid_vector_compressed_iterator<V, U>& it) const {
+		return int64_t(it.i - i);
+	}
+
+	Vector* v;
+	uint64_t i;
+};
+
+/* A vector of trivially copyable T kept compressed in a temporary file.
+ *
+ * Intended as the disk container of a hybrid_vector whose spilled elements
+ * compress well, to cut the I/O of every scan:
+ * 	hybrid_vector<T, std::vector<T>, hybrid_vector_compressed_vector<T> >
+ * The elements are stored in blocks of block_bytes, each encoded on its own
+ * by Codec; an index in memory holds where each block is in the file. An
+ * element lookup decodes its block into a cache of cache_blocks blocks, so
+ * random access is supported, and a reference stays valid until
+ * cache_blocks other blocks have been looked up. A cached block is encoded
+ * and written back when it leaves the cache, if it has changed.
+ *
+ * A block which has grown past its place in the file is written at the end;
+ * the space left behind is reclaimed by clear() and set_content(). As with
+ * stxxl::vector, even const access changes the cache, so the vector may only
+ * be used by one thread at a time.
+ *
+ * The file is created in $TMPDIR (or /tmp) and unlinked at once, so it
+ * disappears with the vector.
+ */
+template <typename T, typename Codec = typename hybrid_vector_default_codec<T>::type>
+class hybrid_vector_compressed_vector
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	BOOST_STATIC_ASSERT(boost::has_trivial_destructor<T>::value);
+	typedef hybrid_vector_compressed_vector<T, Codec> this_type;
+public:
+	typedef T value_type;
+	typedef value_type& reference;
+	typedef const value_type& const_reference;
+	typedef value_type* pointer;
+	typedef const value_type* const_pointer;
+	typedef hybrid_vector_compressed_iterator<this_type, T> iterator;
+	typedef hybrid_vector_compressed_iterator<const this_type, const T> const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef uint64_t size_type;
+	typedef int64_t difference_type;
+
+	enum {
+		block_bytes = 64 << 10,
+		block_elements = sizeof(T) < block_bytes ? block_bytes / sizeof(T) : 1,
+		cache_blocks = 8,
+	};
+
+private:
+	// Where a block is in the file: bytes of its encoding, in room reserved
+	// for it, hold its first count elements. count is 0 if it was never stored.
+	struct block_image {
+		uint64_t offset;
+		uint64_t bytes;
+		uint64_t room;
+		size_type count;
+
+		block_image() :
+				offset(0), bytes(0), room(0), count(0) { }
+	};
+
+	// A decoded block; clean holds the elements as they were decoded
+	struct cache_slot {
+		size_type block;
+		uint64_t used;
+		std::vector<T> data;
+		std::vector<T> clean;
+
+		cache_slot() :
+				block(no_block()), used(0) { }
+	};
+
+	int fd;
+	size_type size_;
+	// Blocks past the end are neither stored nor cached
+	mutable std::vector<block_image> index;
+	mutable uint64_t file_end;
+	mutable std::vector<cache_slot> cache;
+	mutable uint64_t clock;
+	mutable std::size_t last_hit;
+	mutable std::vector<char> scratch;
+
+public:
+	explicit hybrid_vector_compressed_vector(size_type n = 0) :
+			fd(-1), size_(0), file_end(0), cache(cache_blocks), clock(0), last_hit(0) {
+		open_temp();
+		resize(n);
+	}
+
+	hybrid_vector_compressed_vector(const hybrid_vector_compressed_vector& vec) :
+			fd(-1), size_(0), file_end(0), cache(cache_blocks), clock(0), last_hit(0) {
+		open_temp();
+		for (size_type i = 0; i < vec.size_; i += block_elements)
+			store(i / block_elements, &vec[i], std::min<size_type>(block_elements, vec.size_ - i));
+		size_ = vec.size_;
+	}
+
+	hybrid_vector_compressed_vector& operator = (const hybrid_vector_compressed_vector& vec) {
+		if (this != &vec) {
+			hybrid_vector_compressed_vector tmp(vec);
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	~hybrid_vector_compressed_vector() {
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	void swap(hybrid_vector_compressed_vector& vec) {
+		std::swap(fd, vec.fd);
+		std::swap(size_, vec.size_);
+		index.swap(vec.index);
+		std::swap(file_end, vec.file_end);
+		cache.swap(vec.cache);
+		std::swap(clock, vec.clock);
+		std::swap(last_hit, vec.last_hit);
+	}
+
+	bool empty() const {
+		return !size_;
+	}
+	size_type size() const {
+		return size_;
+	}
+	size_type capacity() const {
+		return (size_ + block_elements - 1) / block_elements * block_elements;
+	}
+
+	iterator begin() {
+		return iterator(this, 0);
+	}
+	const_iterator begin() const {
+		return const_iterator(this, 0);
+	}
+	iterator end() {
+		return iterator(this, size_);
+	}
+	const_iterator end() const {
+		return const_iterator(this, size_);
+	}
+
+	reverse_iterator rbegin() {
+		return reverse_iterator(end());
+	}
+	const_reverse_iterator rbegin() const {
+		return const_reverse_iterator(end());
+	}
+	reverse_iterator rend() {
+		return reverse_iterator(begin());
+	}
+	const_reverse_iterator rend() const {
+		return const_reverse_iterator(begin());
+	}
+
+	reference operator [] (size_type n) {
+		return load(n / block_elements).data[n % block_elements];
+	}
+	const_reference operator [] (size_type n) const {
+		return load(n / block_elements).data[n % block_elements];
+	}
+
+	reference front() {
+		return (*this)[0];
+	}
+	const_reference front() const {
+		return (*this)[0];
+	}
+	reference back() {
+		return (*this)[size_ - 1];
+	}
+	const_reference back() const {
+		return (*this)[size_ - 1];
+	}
+
+	void reserve(size_type n) {
+		index.reserve((n + block_elements - 1) / block_elements);
+	}
+
+	// Blocks wholly past the old end start out as T() when first looked up
+	void resize(size_type n) {
+		const size_type tail = size_ % block_elements;
+		if (n < size_) {
+			drop_blocks((n + block_elements - 1) / block_elements);
+		} else if (n > size_ && tail) {
+			cache_slot& s = load(size_ / block_elements);
+			std::fill(s.data.begin() + tail,
+					s.data.begin() + std::min<size_type>(block_elements, tail + (n - size_)), T());
+		}
+		size_ = n;
+	}
+
+	void clear() {
+		size_ = 0;
+		drop_blocks(0);
+		file_end = 0;
+		if (::ftruncate(fd, 0) != 0)
+			fail(BOOST_CURRENT_FUNCTION, "ftruncate");
+	}
+
+	void push_back(const_reference obj) {
+		// obj may live in the block about to leave the cache
+		T tmp(obj);
+		load(size_ / block_elements).data[size_ % block_elements] = tmp;
+		++size_;
+	}
+
+	void pop_back() {
+		if (!(--size_ % block_elements))
+			drop_blocks(size_ / block_elements);
+	}
+
+	// Same as stxxl::vector::set_content; encodes the blocks straight from the input
+	template <typename InIt>
+	void set_content(InIt _Start, InIt _End, size_type n) {
+		clear();
+		std::vector<T> buf;
+		buf.reserve(std::min<size_type>(n, block_elements));
+		while (_Start != _End) {
+			buf.clear();
+			for (; buf.size() < block_elements && _Start != _End; ++_Start)
+				buf.push_back(*_Start);
+			store(size_ / block_elements, &buf[0], buf.size());
+			size_ += buf.size();
+		}
+		BOOST_ASSERT(size_ == n);
+	}
+
+	// Bytes the encoded blocks take in the file
+	uint64_t stored_bytes() const {
+		uint64_t bytes = 0;
+		for (std::size_t k = 0; k < index.size(); ++k)
+			bytes += index[k].bytes;
+		return bytes;
+	}
+
+private:
+	static size_type no_block() {
+		return size_type(-1);
+	}
+
+	static void fail(const char* func, const char* what) {
+		throw std::runtime_error(func + std::string(": ") + what + ": " + std::strerror(errno));
+	}
+
+	void open_temp() {
+		const char* dir = std::getenv("TMPDIR");
+		std::string path = std::string(dir && *dir ? dir : "/tmp") + "/hybrid_vector.XXXXXX";
+		fd = ::mkstemp(&path[0]);
+		if (fd < 0)
+			fail(BOOST_CURRENT_FUNCTION, "mkstemp");
+		::unlink(path.c_str());
+	}
+
+	// Forgets the blocks from @param k on; their room in the file is lost
+	void drop_blocks(size_type k) {
+		if (k < index.size())
+			index.resize(k);
+		for (std::size_t i = 0; i < cache.size(); ++i)
+			if (cache[i].block != no_block() && cache[i].block >= k)
+				cache[i].block = no_block();
+	}
+
+	// The cache slot holding block @param k, decoding it there if need be
+	cache_slot& load(size_type k) const {
+		if (cache[last_hit].block == k) {
+			cache[last_hit].used = ++clock;
+			return cache[last_hit];
+		}
+		std::size_t victim = 0;
+		for (std::size_t i = 0; i < cache.size(); ++i) {
+			if (cache[i].block == k) {
+				last_hit = i;
+				cache[i].used = ++clock;
+				return cache[i];
+			}
+			if (cache[i].used < cache[victim].used)
+				victim = i;
+		}
+		cache_slot& s = cache[victim];
+		write_back(s);
+		s.block = no_block();
+		s.data.resize(block_elements);
+		const size_type count = k < index.size() ? index[k].count : 0;
+		if (count) {
+			const block_image& b = index[k];
+			scratch.resize(b.bytes);
+			read_at(b.offset, &scratch[0], b.bytes);
+			Codec::decode(&scratch[0], b.bytes, &s.data[0], count);
+		}
+		std::fill(s.data.begin() + count, s.data.end(), T());
+		s.clean.assign(s.data.begin(), s.data.begin() + count);
+		s.block = k;
+		s.used = ++clock;
+		last_hit = victim;
+		return s;
+	}
+
+	// Stores the elements of a cached block unless they are stored already
+	void write_back(const cache_slot& s) const {
+		if (s.block == no_block() || s.block * block_elements >= size_)
+			return;
+		const size_type n = std::min<size_type>(block_elements, size_ - s.block * block_elements);
+		if (n <= s.clean.size() && !std::memcmp(&s.data[0], &s.clean[0], n * sizeof(T)))
+			return;
+		store(s.block, &s.data[0], n);
+	}
+
+	// Encodes the @param n elements at @param p as block @param k
+	void store(size_type k, const T* p, size_type n) const {
+		scratch.clear();
+		Codec::encode(p, p + n, scratch);
+		if (k >= index.size())
+			index.resize(k + 1);
+		block_image& b = index[k];
+		if (scratch.size() > b.room) {
+			b.offset = file_end;
+			b.room = scratch.size();
+			file_end += b.room;
+		}
+		write_at(b.offset, &scratch[0], scratch.size());
+		b.bytes = scratch.size();
+		b.count = n;
+	}
+
+	void write_at(uint64_t offset, const char* p, std::size_t bytes) const {
+		while (bytes) {
+			ssize_t k = ::pwrite(fd, p, bytes, offset);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0)
+				fail(BOOST_CURRENT_FUNCTION, "pwrite");
+			p += k;
+			offset += k;
+			bytes -= k;
+		}
+	}
+
+	void read_at(uint64_t offset, char* p, std::size_t bytes) const {
+		while (bytes) {
+			ssize_t k = ::pread(fd, p, bytes, offset);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0)
+				fail(BOOST_CURRENT_FUNCTION, "pread");
+			p += k;
+			offset += k;
+			bytes -= k;
+		}
+	}
+};
+
+template <typename T, typename Codec>
+struct hybrid_vector_segment_traits<hybrid_vector_compressed_vector<T, Codec> > {
+	enum { segment_size = hybrid_vector_compressed_vector<T, Codec>::block_elements };
+};
+
+#endif
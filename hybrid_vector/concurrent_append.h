@@ -0,0 +1,180 @@
+/* hybrid_vector/concurrent_append.h - appending from several threads
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_CONCURRENT_APPEND_H
+#define HYBRID_VECTOR_CONCURRENT_APPEND_H
+
+#include <iterator>
+#include <map>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/config.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <hybrid_vector/c99int.h>
+
+/* Lets several threads append to one vector.
+ *
+ * Each producer fills a stage of its own, without locking. A full stage is
+ * published as a block: it reserves the next indices with an atomic
+ * fetch-add and is queued. Whichever producer finds the vector free appends
+ * the queued blocks in index order; the others queue and go on. So a spill
+ * (or any other slow append) only holds up the producer doing it; with
+ * set_async_spill(1), not even that one.
+ *
+ * While the appender exists, the vector must not be used otherwise; after
+ * drain(), or the appender's destruction, it holds every published element.
+ */
+template <typename Vector>
+class hybrid_vector_concurrent_appender : boost::noncopyable
+{
+public:
+	typedef typename Vector::value_type value_type;
+	typedef uint64_t size_type;
+
+	// A producer's staging buffer, used by one thread at a time
+	class stage : boost::noncopyable
+	{
+	public:
+		explicit stage(hybrid_vector_concurrent_appender& owner_) :
+				owner(&owner_) {
+			buf.reserve(owner->block);
+		}
+
+		~stage() {
+			publish();
+		}
+
+		void push_back(const value_type& obj) {
+			buf.push_back(obj);
+			if (buf.size() >= owner->block)
+				publish();
+		}
+
+		// Hands the staged elements to the vector; returns the index of the first
+		size_type publish() {
+			if (buf.empty())
+				return owner->reserved();
+			std::vector<value_type> full;
+			full.reserve(owner->block);
+			full.swap(buf);
+			return owner->publish(full);
+		}
+
+	private:
+		hybrid_vector_concurrent_appender* owner;
+		std::vector<value_type> buf;
+	};
+
+	// @param block_ is the number of elements a stage publishes at once
+	explicit hybrid_vector_concurrent_appender(Vector& v_, size_type block_ = 1 << 12) :
+			v(&v_), block(block_ ? block_ : 1), next(v_.size()), committed(v_.size()) { }
+
+	~hybrid_vector_concurrent_appender() {
+		drain();
+	}
+
+	// The end of the indices reserved so far
+	size_type reserved() const {
+		return next;
+	}
+
+	/* A snapshot of the vector (see hybrid_vector::snapshot) holding the
+	 * blocks queued so far, for reading while producers go on. It waits for
+	 * an append in progress, but producers never wait for it.
+	 */
+	typename Vector::snapshot_type snapshot() {
+		typename Vector::snapshot_type s;
+		{
+			boost::lock_guard<boost::mutex> lock(commit_mutex);
+			append_queued();
+			s = v->snapshot();
+		}
+		commit();
+		return s;
+	}
+
+	/* Waits for the published blocks to be in the vector. Producers which
+	 * might still publish must have finished, or the wait ends at the first
+	 * block that has been reserved but not queued yet.
+	 */
+	void drain() {
+		boost::lock_guard<boost::mutex> lock(commit_mutex);
+		append_queued();
+	}
+
+private:
+	size_type publish(std::vector<value_type>& buf) {
+		size_type first = next.fetch_add(buf.size());
+		{
+			boost::lock_guard<boost::mutex> lock(queue_mutex);
+			queued[first].swap(buf);
+		}
+		commit();
+		return first;
+	}
+
+	// Appends the queued blocks unless another thread is at it
+	void commit() {
+		for (;;) {
+			boost::unique_lock<boost::mutex> lock(commit_mutex, boost::try_to_lock);
+			// whoever holds it will append them
+			if (!lock.owns_lock())
+				return;
+			append_queued();
+			lock.unlock();
+			// a block queued after we last looked would be left behind
+			boost::lock_guard<boost::mutex> queue_lock(queue_mutex);
+			if (queued.empty() || queued.begin()->first != committed)
+				return;
+		}
+	}
+
+	// Appends the queued blocks that follow the vector; commit_mutex is held
+	void append_queued() {
+		for (;;) {
+			std::vector<value_type> buf;
+			{
+				boost::lock_guard<boost::mutex> lock(queue_mutex);
+				typename std::map<size_type, std::vector<value_type> >::iterator it =
+						queued.find(committed);
+				if (it == queued.end())
+					return;
+				buf.swap(it->second);
+				queued.erase(it);
+			}
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+			v->append(std::make_move_iterator(buf.begin()), std::make_move_iterator(buf.end()));
+#else
+			v->append(buf.begin(), buf.end());
+#endif
+			boost::lock_guard<boost::mutex> lock(queue_mutex);
+			committed += buf.size();
+		}
+	}
+
+	Vector* v;
+	const size_type block;
+	boost::atomic<size_type> next;
+	// The end of the appended blocks; guarded by queue_mutex, and only
+	// changed under commit_mutex as well
+	size_type committed;
+	boost::mutex queue_mutex;
+	std::map<size_type, std::vector<value_type> > queued;
+	boost::mutex commit_mutex;
+};
+
+#endif
@@ -20,17 +20,17 @@
 
 #include <hybrid_vector/fwd.h>
 
-template <typename T, typename rv, typename dv>
+template <typename T, typename rv, typename dv, typename residency>
 class hybrid_vector_const_iterator
 {
-	typedef hybrid_vector_const_iterator<T, rv, dv> this_type;
-	friend class hybrid_vector_iterator<T, rv, dv>;
-	typedef hybrid_vector_iterator<T, rv, dv> non_const_iterator;
+	typedef hybrid_vector_const_iterator<T, rv, dv, residency> this_type;
+	friend class hybrid_vector_iterator<T, rv, dv, residency>;
+	typedef hybrid_vector_iterator<T, rv, dv, residency> non_const_iterator;
 public:
 	typedef non_const_iterator iterator;
 	typedef this_type const_iterator;
-	typedef hybrid_vector<T, rv, dv> vector_type;
-	friend class hybrid_vector<T, rv, dv>;
+	typedef hybrid_vector<T, rv, dv, residency> vector_type;
+	friend class hybrid_vector<T, rv, dv, residency>;
 
 	typedef std::random_access_iterator_tag iterator_category;
 	typedef typename vector_type::size_type size_type;
@@ -45,16 +45,29 @@ protected:
 	const vector_type* parent;
 	size_type off;
 
+	// See hybrid_vector_iterator
+	mutable const_pointer win;
+	mutable size_type win_first;
+	mutable size_type win_last;
+	mutable size_type win_epoch;
+
+	const_reference at(size_type n) const {
+		if (n - win_first >= win_last - win_first || win_epoch != parent->epoch) {
+			win = parent->locate(n, win_first, win_last);
+			win_epoch = parent->epoch;
+		}
+		return win[n - win_first];
+	}
+
 private:
-	hybrid_vector_const_iterator(vector_type* parent_, size_type off_) :
-		parent(parent_), off(off_) { }
+	hybrid_vector_const_iterator(const vector_type* parent_, size_type off_) :
+		parent(parent_), off(off_), win(0), win_first(0), win_last(0), win_epoch(0) { }
 public:
 	hybrid_vector_const_iterator() :
-			parent(0), off(0) { }
+			parent(0), off(0), win(0), win_first(0), win_last(0), win_epoch(0) { }
 	hybrid_vector_const_iterator(const iterator& it) :
-			parent(it.parent), off(it.off) { }
-	hybrid_vector_const_iterator(const const_iterator& it) :
-			parent(it.parent), off(it.off) { }
+			parent(it.parent), off(it.off), win(it.win), win_first(it.win_first),
+			win_last(it.win_last), win_epoch(it.win_epoch) { }
 	
 	difference_type operator - (const iterator& it) const {
 		return off - it.off;
@@ -64,11 +77,15 @@ public:
 	}
 
 	this_type operator - (size_type n) const {
-		return this_type(parent, off - n);
+		this_type tmp = *this;
+		tmp.off -= n;
+		return tmp;
 	}
 
 	this_type operator + (size_type n) const {
-		return this_type(parent, off + n);
+		this_type tmp = *this;
+		tmp.off += n;
+		return tmp;
 	}
 
 	this_type& operator -= (size_type n) {
@@ -82,22 +99,22 @@ public:
 	}
 
 	const_reference operator * () const {
-		return (*parent)[off];
+		return at(off);
 	}
 
-	const_pointer operator -> () {
-		return &((*parent)[off]);
+	const_pointer operator -> () const {
+		return &at(off);
 	}
 
-	const_reference operator [] (size_type n) {
-		return (*parent)[off + n];
+	const_reference operator [] (size_type n) const {
+		return at(off + n);
 	}
 
 	this_type& operator ++ () {
 		++off;
 		return *this;
 	}
-	this_type& operator ++ (int) {
+	this_type operator ++ (int) {
 		this_type tmp = *this;
 		++off;
 		return tmp;
@@ -107,8 +124,8 @@ public:
 		--off;
 		return *this;
 	}
-	this_type& operator -- (int) {
-		iterator tmp = *this;
+	this_type operator -- (int) {
+		this_type tmp = *this;
 		--off;
 		return tmp;
 	}
@@ -127,7 +144,7 @@ public:
 		return off != it.off;
 	}
 	bool operator != (const const_iterator& it) const {
-		BOOSST_ASSERT(parent == it.parent);
+		BOOST_ASSERT(parent == it.parent);
 		return off != it.off;
 	}
 
@@ -15,11 +15,11 @@
 #ifndef HYBRID_VECTOR_FWD_H
 #define HYBRID_VECTOR_FWD_H
 
-template <typename T, typename rv, typename dv>
+template <typename T, typename rv, typename dv, typename residency>
 class hybrid_vector;
-template <typename T, typename rv, typename dv>
+template <typename T, typename rv, typename dv, typename residency>
 class hybrid_vector_iterator;
-template <typename T, typename rv, typename dv>
+template <typename T, typename rv, typename dv, typename residency>
 class hybrid_vector_const_iterator;
 
 #endif
@@ -16,30 +16,66 @@
 #define HYBRID_VECTOR_HYBRID_VECTOR_H
 
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iterator>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <stxxl/vector>
 #include <boost/assert.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/config.hpp>
+#include <boost/chrono/duration.hpp>
+#include <boost/chrono/system_clocks.hpp>
 #include <boost/current_function.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/static_assert.hpp>
 #include <boost/thread/once.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/type_traits/is_integral.hpp>
 
+#include <hybrid_vector/advice.h>
+#include <hybrid_vector/allocator.h>
+#include <hybrid_vector/budget.h>
+#include <hybrid_vector/bulk_io.h>
 #include <hybrid_vector/c99int.h>
+#include <hybrid_vector/compressed_vector.h>
+#include <hybrid_vector/concurrent_append.h>
 #include <hybrid_vector/fwd.h>
 #include <hybrid_vector/iterator.h>
+#include <hybrid_vector/mmap_vector.h>
+#include <hybrid_vector/parallel.h>
+#include <hybrid_vector/persist.h>
 #include <hybrid_vector/const_iterator.h>
 #include <hybrid_vector/pmf.h>
+#include <hybrid_vector/residency.h>
+#include <hybrid_vector/size_estimator.h>
+#include <hybrid_vector/snapshot.h>
+#include <hybrid_vector/stats.h>
+#include <hybrid_vector/segment.h>
+#include <hybrid_vector/sort.h>
+#include <hybrid_vector/spill_policy.h>
 
 #define HYBRID_VECTOR_PP_CONCAT_2(x,y) x##y
 #define HYBRID_VECTOR_PP_CONCAT(x,y) HYBRID_VECTOR_PP_CONCAT_2(x,y)
 
+// Migrations move elements where the language allows it
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+#define HYBRID_VECTOR_MOVE_ITERATOR(it) std::make_move_iterator(it)
+#else
+#define HYBRID_VECTOR_MOVE_ITERATOR(it) (it)
+#endif
+
 template <typename T,
-	  typename rv = std::vector<T>,
-	  typename dv = stxxl::vector<T> >
-class hybrid_vector
+	  typename rv = std::vector<T, typename hybrid_vector_default_allocator<T>::type>,
+	  typename dv = stxxl::vector<T>,
+	  typename residency = hybrid_vector_adaptive>
+class hybrid_vector : private hybrid_vector_budget_client, private hybrid_vector_instrumented
 {
 public:
 	typedef T value_type;
@@ -51,61 +87,198 @@ public:
 	typedef int64_t difference_type;
 	typedef const value_type* const_pointer;
 
-	friend class hybrid_vector_iterator<T, rv, dv>;
-	typedef hybrid_vector_iterator<T, rv, dv> iterator;
-	friend class hybrid_vector_const_iterator<T, rv, dv>;
-	typedef hybrid_vector_iterator<T, rv, dv> const_iterator;
+	friend class hybrid_vector_iterator<T, rv, dv, residency>;
+	typedef hybrid_vector_iterator<T, rv, dv, residency> iterator;
+	friend class hybrid_vector_const_iterator<T, rv, dv, residency>;
+	typedef hybrid_vector_const_iterator<T, rv, dv, residency> const_iterator;
 	typedef std::reverse_iterator<iterator> reverse_iterator;
 	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef hybrid_vector_snapshot<T, rv, dv> snapshot_type;
+	// That of the ram container; the disk container has none
+	typedef typename rv::allocator_type allocator_type;
 
 private:
 	typedef hybrid_vector_pmf<T, rv, dv> pmf;
 	size_type size_;
 
-	// The size which triggers swap_container
-	size_type swap_size;
+	// The sizes which trigger swap_containers
+	hybrid_vector_spill_policy policy;
+	// When swap_containers last moved the elements
+	boost::chrono::steady_clock::time_point last_swap;
 
 	// Forces the use of one container exclusively
 	bool force_ram;
 	bool force_disk;
 
+	// Hands ram->disk migrations off to a background thread
+	bool async;
+
+	// Given to every ram container the vector makes
+	allocator_type alloc;
 	boost::scoped_ptr<rv> p_rv;
 	boost::scoped_ptr<dv> p_dv;
 
+	// In disk state, the elements [p_dv->size(), size_) appended but not yet
+	// written; they go to p_dv one block at a time. Being at most one block,
+	// swapped by value and never handed to the user, it keeps std::allocator
+	// rather than alloc, which need not be equal between two vectors.
+	mutable std::vector<T> wbuf;
+
+	// A background spill copying source, the elements [0, rv_base), into dest.
+	// It lives on the heap so that the vector itself can move meanwhile.
+	struct spill_job {
+		boost::scoped_ptr<rv> source;
+		dv* dest;
+		boost::atomic<bool> done;
+		boost::atomic<bool> cancel;
+		boost::exception_ptr error;
+		boost::scoped_ptr<boost::thread> worker;
+		// Recorded once the copy is done or given up
+		migration_token migration;
+
+		explicit spill_job(const migration_token& migration_) :
+				dest(0), done(0), cancel(0), migration(migration_) { }
+		void run();
+		void join() {
+			if (worker) {
+				worker->join();
+				worker.reset();
+			}
+		}
+	};
+
+	// While spilling, p_rv holds the elements appended since the spill began;
+	// when split, it holds the tail that is kept in ram
+	boost::scoped_ptr<spill_job> p_spill;
+	size_type rv_base;
+
+	/* Bumped whenever elements may have moved: on every size change or
+	 * migration, and on every lookup in the disk container, which may evict
+	 * the block an iterator points into. Iterators cache a run of elements
+	 * for as long as it stays the same.
+	 */
+	mutable size_type epoch;
+
+	// The bytes the elements own on the heap, as hybrid_vector_size_estimator
+	// has it; always 0 for element types which own nothing
+	typedef hybrid_vector_size_estimator<T> estimator;
+	size_type payload;
+
+	// The size reserve() or hint_final_size() announced: placement is
+	// decided for at least this many elements
+	size_type planned;
+
+	// The pattern last given to advise() for the whole vector, and where the
+	// blocks read ahead for a sequential pattern end
+	hybrid_vector_access access;
+	mutable size_type read_ahead_to;
+
 protected:
 	enum selector {
 		uninit = 0,
 		ram = 1,
 		disk = 2,
+		spilling = 3,
+		split = 4,
 	} state;
+
+	// The state, or the only one residency allows, which is a constant
+	selector current() const {
+		return residency::fixed_state ? selector(residency::fixed_state) : state;
+	}
 public:
 	hybrid_vector(size_type n = 0, size_type swap_size_ = 128<<20 /* 128 MB */,
-	              bool force_ram_ = 0, bool force_disk_ = 0) :
+	              bool force_ram_ = 0, bool force_disk_ = 0,
+	              const allocator_type& alloc_ = allocator_type()) :
 			size_(n),
-			swap_size(swap_size_),
+			policy(swap_size_),
 			force_ram(force_ram_),
-			force_disk(force_disk_) {
+			force_disk(force_disk_),
+			async(0),
+			alloc(alloc_),
+			rv_base(0),
+			epoch(0),
+			payload(0),
+			planned(0),
+			access(hybrid_vector_normal),
+			read_ahead_to(0) {
 		__ctor_init(n);
 	}
 
+	hybrid_vector(size_type n, const hybrid_vector_spill_policy& policy_,
+	              bool force_ram_ = 0, bool force_disk_ = 0,
+	              const allocator_type& alloc_ = allocator_type()) :
+			size_(n),
+			policy(policy_),
+			force_ram(force_ram_),
+			force_disk(force_disk_),
+			async(0),
+			alloc(alloc_),
+			rv_base(0),
+			epoch(0),
+			payload(0),
+			planned(0),
+			access(hybrid_vector_normal),
+			read_ahead_to(0) {
+		__ctor_init(n);
+	}
+
+	explicit hybrid_vector(const allocator_type& alloc_) :
+			size_(0),
+			force_ram(0),
+			force_disk(0),
+			async(0),
+			alloc(alloc_),
+			rv_base(0),
+			epoch(0),
+			payload(0),
+			planned(0),
+			access(hybrid_vector_normal),
+			read_ahead_to(0) {
+		__ctor_init(0);
+	}
+
 	template <typename InIt>
 	hybrid_vector(InIt _Start, InIt _End, size_type swap_size_ = 128<<20,
-			bool force_ram_ = 0, bool force_disk_ = 0) :
+			bool force_ram_ = 0, bool force_disk_ = 0,
+			const allocator_type& alloc_ = allocator_type()) :
 			size_(std::distance(_Start, _End)),
-			swap_size(swap_size_),
+			policy(swap_size_),
 			force_ram(force_ram_),
-			force_disk(force_disk_) {
-		__ctor_init(0);
+			force_disk(force_disk_),
+			async(0),
+			alloc(alloc_),
+			rv_base(0),
+			epoch(0),
+			payload(0),
+			planned(0),
+			access(hybrid_vector_normal),
+			read_ahead_to(0) {
+		// placed for the elements to come, so that they are written there
+		__ctor_init(0, size_);
 		assign(_Start, _End);
 	}
 
 	hybrid_vector(const hybrid_vector& vec) :
+			hybrid_vector_budget_client(),
+			hybrid_vector_instrumented(vec),
 			size_(vec.size_),
-			swap_size(vec.swap_size),
+			policy(vec.policy),
+			last_swap(vec.last_swap),
 			force_ram(vec.force_ram),
 			force_disk(vec.force_disk),
+			async(vec.async),
+			alloc(vec.alloc),
+			rv_base(0),
+			epoch(0),
+			payload(vec.payload),
+			planned(vec.planned),
+			access(vec.access),
+			read_ahead_to(0),
 			state(vec.state) {
 		vec.check_consistency();
+		if (state == disk)
+			vec.flush_appends();
 		switch (state) {
 		case ram:
 			p_rv.reset(new rv(*vec.p_rv));
@@ -113,9 +286,22 @@ public:
 		case disk:
 			p_dv.reset(new dv(*vec.p_dv));
 			break;
+		case spilling:
+			// the spilled prefix is still intact in ram; copy it there
+			p_rv.reset(new rv(*vec.p_spill->source));
+			rv_bulk_append(vec.p_rv->begin(), vec.p_rv->end());
+			state = ram;
+			break;
+		case split:
+			p_dv.reset(new dv(*vec.p_dv));
+			p_rv.reset(new rv(*vec.p_rv));
+			rv_base = vec.rv_base;
+			break;
 		default:
 			;
 		}
+		if (vec.budget)
+			attach_budget(*vec.budget);
 	}
 
 	hybrid_vector& operator = (const hybrid_vector& vec) {
@@ -126,6 +312,46 @@ public:
 		return *this;
 	}
 
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	// Takes over the containers (and budget) of @param vec, which is left
+	// empty; only if there is no memory for its new, empty container is it
+	// left fit just for destruction or assignment
+	hybrid_vector(hybrid_vector&& vec) BOOST_NOEXCEPT :
+			size_(0),
+			policy(vec.policy),
+			last_swap(vec.last_swap),
+			force_ram(vec.force_ram),
+			force_disk(vec.force_disk),
+			async(vec.async),
+			alloc(vec.alloc),
+			rv_base(0),
+			epoch(0),
+			payload(0),
+			planned(0),
+			access(hybrid_vector_normal),
+			read_ahead_to(0),
+			state(uninit) {
+		swap(vec);
+		if (vec.budget) {
+			vec.budget->hand_over(&vec, this);
+			budget->update(this, resident_bytes());
+		}
+		try {
+			vec.__ctor_init(0);
+		} catch (...) {
+			vec.state = uninit;
+		}
+	}
+
+	hybrid_vector& operator = (hybrid_vector&& vec) BOOST_NOEXCEPT {
+		if (this != &vec) {
+			hybrid_vector tmp(std::move(vec));
+			swap(tmp);
+		}
+		return *this;
+	}
+#endif
+
 	void swap(hybrid_vector& v);
 
 	bool empty() const {
@@ -163,13 +389,19 @@ public:
 // E.g. g++-4.4 -Wall -ansi pedantic
 #define HYBRID_VECTOR_VMF_CALL(__Func, ... /* return, etc */) \
 	do { \
-		switch (state) { \
+		switch (current()) { \
 		case ram: \
 			__VA_ARGS__ HYBRID_VECTOR_PP_CONCAT(rv_, __Func); \
 			break; \
 		case disk: \
 			__VA_ARGS__ HYBRID_VECTOR_PP_CONCAT(dv_, __Func); \
 			break; \
+		case spilling: \
+			__VA_ARGS__ HYBRID_VECTOR_PP_CONCAT(sv_, __Func); \
+			break; \
+		case split: \
+			__VA_ARGS__ HYBRID_VECTOR_PP_CONCAT(tv_, __Func); \
+			break; \
 		default: \
 			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": bad state")); \
 		}\
@@ -193,36 +425,83 @@ public:
 		return size_;
 	}
 
+	allocator_type get_allocator() const {
+		return alloc;
+	}
+
+	// Moves to the container the spill policy picks for @param n elements
+	// before making room there; see hint_final_size()
 	void reserve(size_type n) {
 		check_consistency();
+		planned = std::max(planned, n);
+		rebalance(size_);
 		HYBRID_VECTOR_VMF_CALL(reserve(n));
 	}
 
 	void resize(size_type n) {
 		check_consistency();
+		if (estimator::has_heap) {
+			if (n < size_)
+				payload -= payload_of(n, size_);
+			else
+				payload += (n - size_) * estimator::heap_bytes(T());
+		}
+		rebalance(n);
 		HYBRID_VECTOR_VMF_CALL(resize(n));
 		size_ = n;
 	}
 
 	void clear() {
 		check_consistency();
-		HYBRID_VECTOR_VMF_CALL(clear);
-		swap_containers(-1);
+		HYBRID_VECTOR_VMF_CALL(clear());
 		size_ = 0;
+		payload = 0;
+		rebalance(0);
 	}
 
 	void push_back(const_reference obj) {
 		check_consistency();
-		if (real_size(++size_) >= swap_size)
-			use_disk();
+		if (state == spilling && p_spill->done)
+			finish_spill();
+		payload += estimator::heap_bytes(obj);
+		rebalance(size_ + 1);
 		HYBRID_VECTOR_VMF_CALL(push_back(obj));
+		++size_;
 	}
 
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	void push_back(value_type&& obj) {
+		check_consistency();
+		if (state == spilling && p_spill->done)
+			finish_spill();
+		payload += estimator::heap_bytes(obj);
+		rebalance(size_ + 1);
+		HYBRID_VECTOR_VMF_CALL(push_back(std::move(obj)));
+		++size_;
+	}
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+	template <typename... Args>
+	void emplace_back(Args&&... args) {
+		check_consistency();
+		if (state == spilling && p_spill->done)
+			finish_spill();
+		rebalance(size_ + 1);
+		HYBRID_VECTOR_VMF_CALL(emplace_back(std::forward<Args>(args)...));
+		++size_;
+		// known only once it is built; counts from the next size change on
+		if (estimator::has_heap)
+			payload += estimator::heap_bytes(static_cast<const hybrid_vector&>(*this).back());
+	}
+#endif
+#endif
+
 	void pop_back() {
 		check_consistency();
+		if (estimator::has_heap)
+			payload -= estimator::heap_bytes(static_cast<const hybrid_vector&>(*this).back());
 		HYBRID_VECTOR_VMF_CALL(pop_back());
-		if (real_size(--size_) < swap_size)
-			use_ram();
+		rebalance(--size_);
 	}
 
 	inline reference back() {
@@ -244,12 +523,9 @@ public:
 	template <typename InIt>
 	void assign(InIt _Start, InIt _End) {
 		check_consistency();
-		typename pmf::dv_size_type n_ = std::distance(_Start, _End);
-		size_type n = real_size(n_);
-		if (n > swap_size)
-			use_disk(); // safe: does nothing if force_ram is set
-		else
-			use_ram(); // safe: does nothing if force_disk is set
+		size_type n = std::distance(_Start, _End);
+		payload = hybrid_vector_heap_bytes<T>(_Start, _End);
+		rebalance(n);
 		HYBRID_VECTOR_VMF_CALL(assign(_Start, _End));
 		size_ = n;
 	}
@@ -258,25 +534,274 @@ public:
 	template <typename InIt>
 	void append(InIt _Start, InIt _End) {
 		check_consistency();
-		size_type n = real_size(std::distance(_Start, _End) + size_);
-		if (n > swap_size)
-			use_disk(); // safe: does nothing if force_ram is set
-		else
-			use_ram(); // safe: does nothing if force_disk is set
+		size_type n = std::distance(_Start, _End) + size_;
+		payload += hybrid_vector_heap_bytes<T>(_Start, _End);
+		rebalance(n);
 		HYBRID_VECTOR_VMF_CALL(bulk_append(_Start, _End));
+		size_ = n;
+	}
+
+	// hybrid_vector-specific member function
+	const hybrid_vector_spill_policy& spill_policy() const {
+		return policy;
+	}
+	// Takes effect at the next size change
+	void set_spill_policy(const hybrid_vector_spill_policy& policy_) {
+		policy = policy_;
+	}
+
+	// hybrid_vector-specific member function
+	/* Announces that the vector will grow to @param n elements. It moves now
+	 * to the container the spill policy picks for that size and makes room
+	 * there, so that a vector bound for disk is written there from the start
+	 * rather than filled in ram and spilled. Until the next hint, placement
+	 * counts at least n elements, as it does after reserve(n); like capacity,
+	 * that outlives clear(). A hint of 0 drops it.
+	 */
+	void hint_final_size(size_type n) {
+		check_consistency();
+		planned = n;
+		rebalance(size_);
+		if (n > size_) {
+			HYBRID_VECTOR_VMF_CALL(reserve(n));
+		}
+	}
+
+	// hybrid_vector-specific member function
+	// Calls f(first, last) with a [T*, T*) range for each contiguous run of the
+	// elements [first, last): a single run in ram, one run per block on disk.
+	// The pointers are only valid until the vector is accessed again.
+	template <typename Func>
+	Func for_each_segment(size_type first, size_type last, Func f) {
+		check_consistency();
+		BOOST_ASSERT(first <= last && last <= size_);
+		HYBRID_VECTOR_VMF_CALL(for_each_segment(first, last, f), return);
+	}
+	template <typename Func>
+	Func for_each_segment(size_type first, size_type last, Func f) const {
+		check_consistency();
+		BOOST_ASSERT(first <= last && last <= size_);
+		HYBRID_VECTOR_VMF_CALL(for_each_segment(first, last, f), return);
+	}
+	template <typename Func>
+	Func for_each_segment(Func f) {
+		return for_each_segment(0, size_, f);
+	}
+	template <typename Func>
+	Func for_each_segment(Func f) const {
+		return for_each_segment(0, size_, f);
+	}
+
+	// hybrid_vector-specific member function
+	// Sorts the elements by @param cmp, keeping equal ones in order if
+	// @param stable is set. In ram this is a parallel sort; on disk it is an
+	// external merge sort using about @param memory bytes of ram, by default
+	// the least of the spill and reload sizes, the budget's free bytes and
+	// 256 MB or so. Also available as hybrid_sort() and hybrid_stable_sort().
+	template <typename Compare>
+	void sort(Compare cmp, bool stable = 0, size_type memory = 0);
+
+	// hybrid_vector-specific member function
+	// When enabled, a spill starts copying the elements to disk on a
+	// background thread and returns at once. Until the copy is done, appends go
+	// to a fresh ram container and const reads are served from ram; anything that
+	// needs the spilled elements mutable (non-const [] below the spill point,
+	// resize below it, etc.) waits for the copy via finish_spill().
+	void set_async_spill(bool on) {
+		async = on;
+	}
+
+	// hybrid_vector-specific member function
+	// Blocks until a background spill, if any, has completed.
+	void finish_spill();
+
+	// hybrid_vector-specific member function
+	// Lets @param b decide, together with the spill policy, whether this vector
+	// may stay in ram: it spills when either the policy or the budget says so,
+	// and reloads only when both agree. Copies join the same budget.
+	void attach_budget(hybrid_vector_budget& b) {
+		detach_budget();
+		b.attach(this);
+		if (state == ram && !force_ram && !b.admit(this, resident_bytes(), 1))
+			swap_containers(1);
+		else
+			b.update(this, resident_bytes());
+	}
+	void detach_budget() {
+		if (budget)
+			budget->detach(this);
+	}
+
+	// hybrid_vector-specific member function
+	// Writes the elements to @param path (see persist.h for the format).
+	// T must be trivially copyable.
+	void save(const std::string& path) const;
+
+	// hybrid_vector-specific member function
+	// Opens a file written by save(). The vector starts out on disk: if dv can
+	// use the file in place, as hybrid_vector_mmap_vector does, this takes O(1)
+	// and @param mode applies; otherwise the elements are read into a new dv,
+	// which takes O(n). The default stxxl::vector is one of those.
+	// @param verify also checks the checksum, which reads every element.
+	static hybrid_vector open(const std::string& path,
+	                          hybrid_vector_open_mode mode = hybrid_vector_copy_on_write,
+	                          bool verify = 0);
+
+	// hybrid_vector-specific member function
+	// Whether every element is in the ram container, so that the runs passed
+	// by for_each_segment stay valid, and may be used from several threads,
+	// until the vector is modified
+	bool in_ram() const {
+		return current() == ram;
+	}
+
+	// hybrid_vector-specific member function
+	// Bytes held by the ram container(s), with what their elements own
+	size_type resident_bytes() const {
+		switch (current()) {
+		case ram:
+			return real_size(p_rv->capacity()) + payload;
+		case spilling:
+			return real_size(p_spill->source->capacity() + p_rv->capacity()) + payload;
+		case split:
+			// the tail's share
+			return real_size(p_rv->capacity()) + (size_ ? payload / size_ * p_rv->size() : 0);
+		case disk:
+			return real_size(wbuf.capacity());
+		default:
+			return 0;
+		}
+	}
+
+	/* hybrid_vector-specific member function
+	 * Tells the disk container how the elements [first, last) will be
+	 * accessed (see hybrid_vector_advice_traits); the part in ram needs no
+	 * advice. sequential, random and normal also become the pattern of the
+	 * whole vector: while it is sequential, an iterator moving onto a new
+	 * block on disk has the next read_ahead_chunks chunks read ahead.
+	 * Only disk containers with hybrid_vector_advice_traits (the mmap
+	 * backend) act on advice; with stxxl::vector it does nothing.
+	 */
+	void advise(size_type first, size_type last, hybrid_vector_access how);
+	void advise(hybrid_vector_access how) {
+		advise(0, size_, how);
+	}
+
+	// hybrid_vector-specific member function
+	// Counts the heap bytes of the elements again, after they were changed in
+	// place; changes through references and iterators are not seen otherwise
+	void recount_payload() {
+		check_consistency();
+		payload = estimator::has_heap ? payload_of(0, size_) : 0;
+	}
+
+	/* hybrid_vector-specific member function
+	 * The elements as they are now, in containers of their own (see
+	 * hybrid_vector/snapshot.h). The snapshot stays valid across later
+	 * appends, migrations and the vector's destruction, so other threads may
+	 * read it while this one goes on writing; taking it is itself a read of
+	 * the vector. The ram part is copied; the disk part is frozen by
+	 * hybrid_vector_snapshot_traits. A hybrid_vector_mmap_vector shares its
+	 * file, which goes on growing in place: only pages the vector overwrites
+	 * below a snapshot are copied, in memory, and a later snapshot takes a
+	 * copy of those and scans one page table entry per page shared before.
+	 * Any other disk container, stxxl::vector included, is copied whole,
+	 * which reads and writes every element on disk.
+	 */
+	snapshot_type snapshot() const;
+
+	/* hybrid_vector-specific member functions
+	 * Raw binary I/O of trivially copyable T: the elements back to back in
+	 * native byte order, with no header (see save() and open() for files
+	 * with one). A file descriptor is read or written from its offset.
+	 *
+	 * import_from() appends @param count elements. The spill decision is
+	 * made once for the final size, as with append(). In ram they are read
+	 * straight into the ram container. On disk, hybrid_vector_fd_traits may
+	 * move them from a file descriptor into the disk container in the
+	 * kernel; otherwise they are read into one of two page-aligned buffers
+	 * on a pool thread while the other one is written to the disk
+	 * container. If the input ends early, this throws, and the vector is
+	 * shrunk back to its old size.
+	 *
+	 * export_to() writes the elements [first, last) the same way round:
+	 * from the ram container directly, and from the disk container through
+	 * hybrid_vector_fd_traits or with the two buffers.
+	 */
+	void import_from(int fd, size_type count) {
+		hybrid_vector_detail::fd_source src(fd);
+		import_elements(src, count);
+	}
+	void import_from(std::istream& is, size_type count) {
+		hybrid_vector_detail::stream_source src(is);
+		import_elements(src, count);
+	}
+	void export_to(int fd, size_type first, size_type last) const {
+		hybrid_vector_detail::fd_sink sink(fd);
+		export_elements(sink, first, last);
+	}
+	void export_to(std::ostream& os, size_type first, size_type last) const {
+		hybrid_vector_detail::stream_sink sink(os);
+		export_elements(sink, first, last);
 	}
+	void export_to(int fd) const {
+		export_to(fd, 0, size_);
+	}
+	void export_to(std::ostream& os) const {
+		export_to(os, 0, size_);
+	}
+
+#ifdef HYBRID_VECTOR_STATS
+	// hybrid_vector-specific member functions; see hybrid_vector/stats.h
+	using hybrid_vector_instrumented::stats;
+	using hybrid_vector_instrumented::set_migration_hooks;
+#endif
 
-	// insert
-	// WARNING: wrapper for append
+	/* insert, erase
+	 * Elements after the point of change are shifted: in ram by the ram
+	 * container; on disk a chunk at a time, streaming them through a buffer.
+	 * In split state, a change before the tail first moves the tail to disk.
+	 */
 	template <typename InIt>
 	void insert(iterator pos, InIt _Start, InIt _End) {
-		BOOST_ASSERT(pos == end());
-		append(_Start, _End);
+		insert_dispatch(pos.off, _Start, _End, boost::is_integral<InIt>());
+	}
+
+	void insert(iterator pos, size_type n, const_reference obj) {
+		// obj may be one of ours, which the gap moves
+		T value(obj);
+		insert_at(pos.off, n, hybrid_vector_segment_setter<T>(value), n * estimator::heap_bytes(value));
+	}
+
+	iterator insert(iterator pos, const_reference obj) {
+		insert(pos, 1, obj);
+		return iterator(this, pos.off);
+	}
+
+	iterator erase(iterator _First, iterator _Last) {
+		erase_at(_First.off, _Last.off);
+		return iterator(this, _First.off);
+	}
+
+	iterator erase(iterator pos) {
+		return erase(pos, pos + 1);
 	}
 
+private:
+	// append(), after rebalance() has been called for the final size
+	template <typename InIt>
+	void append_placed(InIt _Start, InIt _End) {
+		size_type n = std::distance(_Start, _End) + size_;
+		payload += hybrid_vector_heap_bytes<T>(_Start, _End);
+		HYBRID_VECTOR_VMF_CALL(bulk_append(_Start, _End));
+		size_ = n;
+	}
+public:
+
 #undef HYBRID_VECTOR_VMF_CALL
 
 	~hybrid_vector() {
+		detach_budget();
 		switch (state) {
 		case ram:
 			p_rv.reset();
@@ -284,6 +809,13 @@ public:
 		case disk:
 			p_dv.reset();
 			break;
+		case spilling:
+			cancel_spill(0);
+			break;
+		case split:
+			p_rv.reset();
+			p_dv.reset();
+			break;
 		default:
 			;
 		}
@@ -295,6 +827,7 @@ protected:
 		return p_rv->capacity();
 	}
 	typename pmf::dv_size_type dv_capacity() const {
+		flush_appends();
 		return p_dv->capacity();
 	}
 
@@ -302,6 +835,7 @@ protected:
 		return p_rv->size();
 	}
 	typename pmf::dv_size_type dv_size() const {
+		flush_appends();
 		return p_dv->size();
 	}
 	
@@ -316,6 +850,7 @@ protected:
 		p_rv->resize(_1);
 	}
 	void dv_resize(typename pmf::dv_size_type _1) {
+		flush_appends();
 		p_dv->resize(_1);
 	}
 
@@ -323,6 +858,7 @@ protected:
 		p_rv->clear();
 	}
 	void dv_clear() {
+		wbuf.clear();
 		p_dv->clear();
 	}
 
@@ -330,34 +866,97 @@ protected:
 		p_rv->push_back(_1);
 	}
 	void dv_push_back(const T& _1) {
-		p_dv->push_back(_1);
+		wbuf.push_back(_1);
+		if (wbuf.size() >= flush_chunk())
+			flush_appends();
 	}
 
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	void rv_push_back(T&& _1) {
+		p_rv->push_back(std::move(_1));
+	}
+	void dv_push_back(T&& _1) {
+		wbuf.push_back(std::move(_1));
+		if (wbuf.size() >= flush_chunk())
+			flush_appends();
+	}
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+	template <typename... Args>
+	void rv_emplace_back(Args&&... args) {
+		p_rv->emplace_back(std::forward<Args>(args)...);
+	}
+	template <typename... Args>
+	void dv_emplace_back(Args&&... args) {
+		wbuf.emplace_back(std::forward<Args>(args)...);
+		if (wbuf.size() >= flush_chunk())
+			flush_appends();
+	}
+#endif
+#endif
+
 	void rv_pop_back() {
 		p_rv->pop_back();
 	}
 	void dv_pop_back() {
-		p_dv->pop_back();
+		if (wbuf.empty())
+			p_dv->pop_back();
+		else
+			wbuf.pop_back();
 	}
 
 	// overloads: get correct pmf via typedef then do call
 	// a bit messier than the "clean ones"
 	reference rv_operator_subscript(typename pmf::rv_size_type _1) {
 		static const typename pmf::rv_get_ref p(&rv::operator[]);
-		return (p_rv->*p)(_1);
+		count_access(1);
+		return ((*p_rv).*p)(_1);
 	}
 	reference dv_operator_subscript(typename pmf::dv_size_type _1) {
 		static const typename pmf::dv_get_ref p(&dv::operator[]);
-		return (p_dv->*p)(_1);
+		++epoch;
+		count_access(0);
+		if (!wbuf.empty() && _1 >= p_dv->size())
+			return wbuf[_1 - p_dv->size()];
+		return ((*p_dv).*p)(_1);
 	}
 	
 	const_reference rv_operator_subscript(typename pmf::rv_size_type _1) const {
 		static const typename pmf::rv_get_cref p(&rv::operator[]);
-		return (p_rv->*p)(_1);
+		count_access(1);
+		return ((*p_rv).*p)(_1);
 	}
 	const_reference dv_operator_subscript(typename pmf::dv_size_type _1) const {
 		static const typename pmf::dv_get_cref p(&dv::operator[]);
-		return (p_dv->*p)(_1);
+		++epoch;
+		count_access(0);
+		if (!wbuf.empty() && _1 >= p_dv->size())
+			return wbuf[_1 - p_dv->size()];
+		return ((*p_dv).*p)(_1);
+	}
+
+	template <typename Func>
+	Func rv_for_each_segment(size_type first, size_type last, Func f) {
+		return hybrid_vector_for_each_segment<pointer>(*p_rv, first, last, f);
+	}
+	template <typename Func>
+	Func dv_for_each_segment(size_type first, size_type last, Func f) {
+		flush_appends();
+		++epoch;
+		return hybrid_vector_for_each_segment<pointer>(*p_dv, first, last, f);
+	}
+
+	template <typename Func>
+	Func rv_for_each_segment(size_type first, size_type last, Func f) const {
+		return hybrid_vector_for_each_segment<const_pointer>(
+				static_cast<const rv&>(*p_rv), first, last, f);
+	}
+	template <typename Func>
+	Func dv_for_each_segment(size_type first, size_type last, Func f) const {
+		flush_appends();
+		++epoch;
+		return hybrid_vector_for_each_segment<const_pointer>(
+				static_cast<const dv&>(*p_dv), first, last, f);
 	}
 
 	template <typename InIt>
@@ -378,36 +977,269 @@ protected:
 	}
 	template <typename InIt>
 	void dv_bulk_append(InIt _Start, InIt _End) {
-		dv_reserve(dv_size() + std::distance(_Start, _End));
-		std::for_each(_Start, _End, boost::bind(&dv_push_back, _1));
+		flush_appends();
+		hybrid_vector_append_segments(*p_dv, _Start, std::distance(_Start, _End));
+	}
+
+	// spilling: [0, rv_base) is in *p_spill (and being copied to *p_dv),
+	// [rv_base, size_) is in *p_rv
+	typename pmf::rv_size_type sv_capacity() const {
+		return rv_base + p_rv->capacity();
+	}
+
+	void sv_reserve(size_type n) {
+		if (n > rv_base)
+			p_rv->reserve(n - rv_base);
+	}
+
+	void sv_resize(size_type n) {
+		if (n >= rv_base) {
+			p_rv->resize(n - rv_base);
+		} else {
+			finish_spill();
+			dv_resize(n);
+		}
+	}
+
+	void sv_clear() {
+		cancel_spill(0);
+		rv_clear();
+	}
+
+	void sv_push_back(const T& _1) {
+		p_rv->push_back(_1);
+	}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	void sv_push_back(T&& _1) {
+		p_rv->push_back(std::move(_1));
+	}
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+	template <typename... Args>
+	void sv_emplace_back(Args&&... args) {
+		p_rv->emplace_back(std::forward<Args>(args)...);
+	}
+#endif
+#endif
+
+	void sv_pop_back() {
+		if (p_rv->empty()) {
+			finish_spill();
+			dv_pop_back();
+		} else {
+			p_rv->pop_back();
+		}
+	}
+
+	reference sv_operator_subscript(size_type _1) {
+		if (_1 >= rv_base)
+			return rv_operator_subscript(_1 - rv_base);
+		// the caller may write through the reference, so the copy must be done
+		finish_spill();
+		return dv_operator_subscript(_1);
+	}
+	const_reference sv_operator_subscript(size_type _1) const {
+		if (_1 >= rv_base)
+			return rv_operator_subscript(_1 - rv_base);
+		return static_cast<const rv&>(*p_spill->source)[_1];
+	}
+
+	template <typename Func>
+	Func sv_for_each_segment(size_type first, size_type last, Func f) {
+		finish_spill();
+		return dv_for_each_segment(first, last, f);
+	}
+	template <typename Func>
+	Func sv_for_each_segment(size_type first, size_type last, Func f) const {
+		if (first < rv_base)
+			f = hybrid_vector_for_each_segment<const_pointer>(
+					static_cast<const rv&>(*p_spill->source), first, std::min(last, rv_base), f);
+		if (last > rv_base)
+			f = rv_for_each_segment(std::max(first, rv_base) - rv_base, last - rv_base, f);
+		return f;
+	}
+
+	template <typename InIt>
+	void sv_assign(InIt _Start, InIt _End) {
+		finish_spill();
+		dv_assign(_Start, _End);
+	}
+
+	template <typename InIt>
+	void sv_bulk_append(InIt _Start, InIt  _End) {
+		rv_bulk_append(_Start, _End);
+	}
+
+	// split: [0, rv_base) is in *p_dv, the tail [rv_base, size_) is in *p_rv
+	typename pmf::rv_size_type tv_capacity() const {
+		return rv_base + p_rv->capacity();
+	}
+
+	// the tail is bounded, so room is made where the elements will end up
+	void tv_reserve(size_type n) {
+		dv_reserve(n);
+	}
+
+	void tv_resize(size_type n) {
+		if (n < rv_base) {
+			p_rv->clear();
+			dv_resize(n);
+		} else if (n - rv_base <= tail_elements()) {
+			p_rv->resize(n - rv_base);
+			return;
+		} else {
+			flush_tail(p_rv->size());
+			dv_resize(n);
+		}
+		rv_base = n;
+	}
+
+	void tv_clear() {
+		p_rv->clear();
+		dv_clear();
+		rv_base = 0;
+	}
+
+	void tv_push_back(const T& _1) {
+		p_rv->push_back(_1);
+		trim_tail();
+	}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	void tv_push_back(T&& _1) {
+		p_rv->push_back(std::move(_1));
+		trim_tail();
+	}
+
+#ifndef BOOST_NO_CXX11_VARIADIC_TEMPLATES
+	template <typename... Args>
+	void tv_emplace_back(Args&&... args) {
+		p_rv->emplace_back(std::forward<Args>(args)...);
+		trim_tail();
+	}
+#endif
+#endif
+
+	void tv_pop_back() {
+		if (p_rv->empty()) {
+			dv_pop_back();
+			--rv_base;
+		} else {
+			p_rv->pop_back();
+		}
+	}
+
+	reference tv_operator_subscript(size_type _1) {
+		if (_1 >= rv_base)
+			return rv_operator_subscript(_1 - rv_base);
+		return dv_operator_subscript(_1);
+	}
+	const_reference tv_operator_subscript(size_type _1) const {
+		if (_1 >= rv_base)
+			return rv_operator_subscript(_1 - rv_base);
+		return dv_operator_subscript(_1);
+	}
+
+	template <typename Func>
+	Func tv_for_each_segment(size_type first, size_type last, Func f) {
+		if (first < rv_base)
+			f = dv_for_each_segment(first, std::min(last, rv_base), f);
+		if (last > rv_base)
+			f = rv_for_each_segment(std::max(first, rv_base) - rv_base, last - rv_base, f);
+		return f;
+	}
+	template <typename Func>
+	Func tv_for_each_segment(size_type first, size_type last, Func f) const {
+		if (first < rv_base)
+			f = dv_for_each_segment(first, std::min(last, rv_base), f);
+		if (last > rv_base)
+			f = rv_for_each_segment(std::max(first, rv_base) - rv_base, last - rv_base, f);
+		return f;
+	}
+
+	template <typename InIt>
+	void tv_assign(InIt _Start, InIt _End) {
+		p_rv->clear();
+		dv_assign(_Start, _End);
+		rv_base = dv_size();
+	}
+
+	// a range longer than the tail goes straight to disk, save for its end
+	template <typename InIt>
+	void tv_bulk_append(InIt _Start, InIt  _End) {
+		size_type n = std::distance(_Start, _End);
+		if (p_rv->size() + n <= tail_elements() + tail_chunk()) {
+			rv_bulk_append(_Start, _End);
+			trim_tail();
+			return;
+		}
+		flush_tail(p_rv->size());
+		InIt mid = _Start;
+		std::advance(mid, n - std::min(n, tail_elements()));
+		dv_bulk_append(_Start, mid);
+		rv_base = dv_size();
+		rv_bulk_append(mid, _End);
 	}
 
 	void use_ram(bool and_stay_there = 0) {
+		if (residency::fixed_state)
+			return;
 		force_disk = force_ram = 0;
 		swap_containers(-1);
 		force_ram = and_stay_there;
 	}
 	void use_disk(bool and_stay_there = 0) {
+		if (residency::fixed_state)
+			return;
 		force_disk = force_ram = 0;
 		swap_containers(1);
 		force_disk = and_stay_there;
 	}
 
 private:
-	void __ctor_init(size_type n) {
+	// Makes the container for @param n elements, chosen as if for @param place
+	// when that is more
+	void __ctor_init(size_type n, size_type place = 0) {
+		if (residency::fixed_state == ram)
+			force_ram = 1;
+		else if (residency::fixed_state == disk)
+			force_disk = 1;
 		if (force_ram && force_disk)
 			throw std::invalid_argument("both force_ram and force_disk are enabled");
-		size_type true_size = real_size(n);
-		if (force_disk || true_size > swap_size) {
+		payload = n * estimator::heap_bytes(T());
+		size_type true_size = real_size(std::max(n, place)) + payload;
+		last_swap = boost::chrono::steady_clock::now();
+		if (force_disk || (!force_ram && policy.wants_disk(true_size))) {
 			state = disk;
 			p_dv.reset(new dv(n));
 		} else {
 			state = ram;
-			p_rv.reset(new rv(n));
+			p_rv.reset(new rv(alloc));
+			p_rv->resize(n);
 		}
 		check_consistency();
 	}
 
+	/* Finds the contiguous run of elements holding element @param n, for the
+	 * iterators: sets [first, last) to the indices it covers and returns the
+	 * address of element first, valid while epoch stays the same.
+	 */
+	pointer locate(size_type n, size_type& first, size_type& last);
+	const_pointer locate(size_type n, size_type& first, size_type& last) const;
+
+	// The same within @param c, which holds the elements [base, end)
+	template <typename Pointer, typename Container>
+	static Pointer locate_in(Container& c, size_type base, size_type end, size_type n,
+	                         size_type& first, size_type& last) {
+		const size_type seg = hybrid_vector_segment_traits<Container>::segment_size;
+		size_type lo = seg ? (n - base) / seg * seg : 0;
+		size_type hi = seg ? std::min(end - base, lo + seg) : end - base;
+		first = base + lo;
+		last = base + hi;
+		return &c[lo];
+	}
+
 	/* This is a sanity check to ensure that the invariants are correct.
 	 * The following are verified:
 	 * 	* only one container is active
@@ -416,7 +1248,7 @@ private:
 	 * Naturally, there is noticeable overhead, hence pass NDEBUG to the compiler when
 	 * debugging is not required.
 	 */
-	void check_consistency();
+	void check_consistency() const;
 
 	/* Swaps containers upon request.
 	 * Use of @param direction allows us to avoid infinite loops
@@ -426,28 +1258,516 @@ private:
 	 */
 	void swap_containers(signed char direction);
 
+	/* Consults the spill policy for a vector of @param n elements and
+	 * swaps containers if it asks for the other one.
+	 */
+	void rebalance(size_type n);
+
+	/* Budget checks for rebalance().
+	 * budget_admits() asks to keep @param n elements in ram, reporting growth
+	 * of the ram container; budget_readmits() asks to bring them back.
+	 * Both are true when no budget is attached.
+	 */
+	bool budget_admits(size_type n);
+	bool budget_readmits(size_type n);
+
+	// What the ram container will hold once it has room for @param n elements;
+	// std::vector grows geometrically
+	size_type ram_bytes_after(size_type n) const {
+		size_type cap = rv_capacity();
+		return real_size(n > cap ? std::max(n, 2 * cap) : cap) + payload;
+	}
+
+	/* The bytes spill decisions are made on, for @param n elements: the
+	 * elements, what they own, and the slack in the ram container. Away from
+	 * ram, that is the container a reload would fill exactly, once it has
+	 * grown again, so that a reload is not undone by the next reallocation.
+	 */
+	size_type footprint(size_type n) const {
+		if (state == ram)
+			return ram_bytes_after(n);
+		return real_size(2 * n) + payload;
+	}
+
+	// Starts reading the chunks after element @param n of the disk container,
+	// which holds [0, end), once a sequential reader gets near the last ones
+	enum { read_ahead_chunks = 4 };
+	void read_ahead(size_type n, size_type end) const {
+		const size_type window = read_ahead_chunks * flush_chunk();
+		if (access != hybrid_vector_sequential || n + window / 2 < read_ahead_to)
+			return;
+		size_type from = std::max(n, read_ahead_to);
+		size_type to = std::min(end, n + window);
+		if (from < to)
+			hybrid_vector_advice_traits<dv>::prefetch(*p_dv, from, to);
+		read_ahead_to = to;
+	}
+
+	// The heap bytes of the elements [first, last)
+	size_type payload_of(size_type first, size_type last) const {
+		return for_each_segment(first, last, hybrid_vector_heap_counter<T>()).bytes;
+	}
+
+	/* Split state helpers.
+	 * start_split() puts all but the tail on disk. trim_tail() moves the
+	 * oldest elements of the tail to disk, whole chunks at a time, once it has
+	 * grown a chunk past tail_size; flush_tail() moves the first @param n.
+	 * end_split() moves the whole tail to disk.
+	 */
+	void start_split();
+	void trim_tail();
+	void flush_tail(size_type n);
+
+	// insert(), after telling a range from (count, value) when both are integers
+	template <typename InIt>
+	void insert_dispatch(size_type pos, InIt _Start, InIt _End, boost::false_type) {
+		if (pos == size_) {
+			append(_Start, _End);
+			return;
+		}
+		insert_at(pos, std::distance(_Start, _End), hybrid_vector_segment_filler<InIt>(_Start),
+				hybrid_vector_heap_bytes<T>(_Start, _End));
+	}
+	template <typename Integer>
+	void insert_dispatch(size_type pos, Integer n, Integer obj, boost::true_type) {
+		insert_at(pos, n, hybrid_vector_segment_setter<T>(T(obj)), n * estimator::heap_bytes(T(obj)));
+	}
+
+	/* Opens a gap of @param n elements at @param pos, which @param fill, a
+	 * segment visitor, then assigns; the new elements own @param heap bytes.
+	 * erase_at() closes the gap [first, last).
+	 * dv_move() moves the elements [first, last) of the disk container to
+	 * @param dest a chunk at a time, in whichever direction keeps the source
+	 * intact until it has been read.
+	 */
+	template <typename Filler>
+	void insert_at(size_type pos, size_type n, Filler fill, size_type heap);
+	void erase_at(size_type first, size_type last);
+	void dv_move(size_type first, size_type last, size_type dest);
+	void end_split();
+
+	// The default working memory of sort() on disk. The spill policy may be
+	// set to let the budget alone decide, so this is bounded on its own too.
+	enum { sort_chunks = 64 };
+	size_type sort_memory() const {
+		size_type bytes = std::min(policy.spill_size, policy.reload_size);
+		bytes = std::min(bytes, real_size(sort_chunks * io_chunk()));
+		if (budget) {
+			const size_type limit = budget->get_limit(), used = budget->resident();
+			bytes = std::min(bytes, limit > used ? limit - used : 0);
+		}
+		// room for a run and a merge buffer at least
+		return std::max(bytes, real_size(2 * io_chunk()));
+	}
+
+	// The elements import_elements() and export_elements() move at a time:
+	// whole disk blocks, about 4 MB
+	static size_type io_chunk() {
+		return flush_chunk() * std::max<size_type>((size_type(4) << 20) / (flush_chunk() * sizeof(T)), 1);
+	}
+	template <typename Source>
+	void import_elements(Source& src, size_type count);
+	template <typename Sink>
+	void export_elements(Sink& sink, size_type first, size_type last) const;
+
+	/* Whole-container moves for swap_containers.
+	 * store_ram() fills a new disk container from the ram container;
+	 * load_disk() appends the disk container's elements to @param out.
+	 * Trivially copyable elements go io_chunk() at a time, as block copies
+	 * between the disk container's segments and the ram container's buffer,
+	 * with the chunks done with advised away; others go through iterators.
+	 */
+	typedef boost::integral_constant<bool, boost::has_trivial_copy<T>::value &&
+			hybrid_vector_segment_traits<rv>::segment_size == 0> block_migration;
+	void store_ram(boost::true_type);
+	void store_ram(boost::false_type);
+	void load_disk(rv& out, boost::true_type);
+	void load_disk(rv& out, boost::false_type);
+
+	// Elements in (or on their way to) the disk container
+	size_type disk_elements() const {
+		return state == disk ? size_ : state == ram ? 0 : rv_base;
+	}
+
+	size_type tail_elements() const {
+		return policy.tail_size / sizeof(T);
+	}
+
+	// Writes out wbuf
+	void flush_appends() const {
+		if (wbuf.empty())
+			return;
+		++epoch;
+		hybrid_vector_append_segments(*p_dv, HYBRID_VECTOR_MOVE_ITERATOR(wbuf.begin()), wbuf.size());
+		wbuf.clear();
+	}
+
+	// Elements moved to disk at a time: one block where dv has blocks
+	static size_type flush_chunk() {
+		const size_type seg = hybrid_vector_segment_traits<dv>::segment_size;
+		return seg ? seg : size_type(1) << 16;
+	}
+	// The same for trim_tail(), which otherwise moves an eighth of the tail
+	size_type tail_chunk() const {
+		const size_type seg = hybrid_vector_segment_traits<dv>::segment_size;
+		return seg ? seg : std::max<size_type>(tail_elements() / 8, 1);
+	}
+
+	/* Background spill helpers.
+	 * start_spill() moves the ram container aside and starts a spill_job,
+	 * which copies it into a new disk container one block at a time; @param m
+	 * is the migration, which finish_spill() records.
+	 * cancel_spill() stops the job and returns to ram, keeping the elements
+	 * only if @param keep is set.
+	 */
+	void start_spill(migration_token& m);
+	void cancel_spill(bool keep);
+
 	static size_type real_size(size_type n) {
 		return n * sizeof(T);
 	}
 
 };
 
-template <typename T, typename rv, typename dv>
-void hybrid_vector<T, rv, dv>::swap(hybrid_vector<T, rv, dv>& v)
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::swap(hybrid_vector<T, rv, dv, residency>& v)
 {
 	std::swap(size_, v.size_);
-	std::swap(swap_size, v.swap_size);
+	std::swap(policy, v.policy);
+	std::swap(last_swap, v.last_swap);
 	std::swap(force_ram, v.force_ram);
 	std::swap(force_disk, v.force_disk);
+	std::swap(async, v.async);
 	std::swap(state, v.state);
+	std::swap(alloc, v.alloc);
 	p_rv.swap(v.p_rv);
 	p_dv.swap(v.p_dv);
+	wbuf.swap(v.wbuf);
+	p_spill.swap(v.p_spill);
+	std::swap(rv_base, v.rv_base);
+	std::swap(payload, v.payload);
+	std::swap(planned, v.planned);
+	std::swap(access, v.access);
+	read_ahead_to = v.read_ahead_to = 0;
+	++epoch;
+	++v.epoch;
+	if (budget)
+		budget->update(this, resident_bytes());
+	if (v.budget)
+		v.budget->update(&v, v.resident_bytes());
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::save(const std::string& path) const
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	// write next to the target, then move it in place
+	std::string tmp_path = path + ".tmp";
+	std::ofstream os(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!os)
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": cannot create ") + tmp_path);
+	hybrid_vector_segment_writer w = for_each_segment(hybrid_vector_segment_writer(os));
+	hybrid_vector_file_header(sizeof(T), size_, w.sum.value).write(os);
+	os.close();
+	if (!os || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+		std::remove(tmp_path.c_str());
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": cannot write ") + path);
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+hybrid_vector<T, rv, dv, residency> hybrid_vector<T, rv, dv, residency>::open(const std::string& path,
+		hybrid_vector_open_mode mode, bool verify)
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	std::ifstream is(path.c_str(), std::ios::binary);
+	if (!is)
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": cannot open ") + path);
+	hybrid_vector_file_header h;
+	h.read(is, sizeof(T));
+	boost::scoped_ptr<dv> d(hybrid_vector_file_traits<dv>::attach(path, 0, h.count, mode));
+	if (!d) {
+		d.reset(new dv(h.count));
+		hybrid_vector_for_each_segment<pointer>(*d, 0, h.count, hybrid_vector_segment_reader(is));
+	}
+	if (verify && hybrid_vector_for_each_segment<const_pointer>(static_cast<const dv&>(*d),
+				0, h.count, hybrid_vector_checksum()).value != h.checksum)
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": checksum mismatch in ") + path);
+	hybrid_vector v;
+	v.size_ = h.count;
+	if (residency::fixed_state == ram) {
+		v.p_rv->assign(d->begin(), d->end());
+		return v;
+	}
+	v.p_rv.reset();
+	v.p_dv.swap(d);
+	v.state = disk;
+	return v;
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+template <typename Compare>
+void hybrid_vector<T, rv, dv, residency>::sort(Compare cmp, bool stable, size_type memory)
+{
+	check_consistency();
+	++epoch;
+	finish_spill();
+	// the tail is sorted along with the rest; it refills as the vector grows
+	if (state == split)
+		end_split();
+	if (state == ram) {
+		hybrid_vector_parallel_sort(p_rv->begin(), p_rv->end(), cmp, stable);
+	} else {
+		flush_appends();
+		hybrid_vector_external_sort(*p_dv, cmp, memory ? memory : sort_memory(), stable);
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+typename hybrid_vector<T, rv, dv, residency>::pointer hybrid_vector<T, rv, dv, residency>::locate(size_type n,
+		size_type& first, size_type& last)
+{
+	check_consistency();
+	// as with operator [], the caller may write through the result
+	if (state == spilling && n < rv_base)
+		finish_spill();
+	const bool in_rv = current() == ram || (current() != disk && n >= rv_base);
+	count_access(in_rv);
+	switch (current()) {
+	case ram:
+		return locate_in<pointer>(*p_rv, 0, size_, n, first, last);
+	case disk: {
+		flush_appends();
+		++epoch;
+		pointer p = locate_in<pointer>(*p_dv, 0, size_, n, first, last);
+		read_ahead(last, size_);
+		return p;
+	}
+	case spilling:
+	case split: {
+		if (in_rv)
+			return locate_in<pointer>(*p_rv, rv_base, size_, n, first, last);
+		++epoch;
+		pointer p = locate_in<pointer>(*p_dv, 0, rv_base, n, first, last);
+		read_ahead(last, rv_base);
+		return p;
+	}
+	default:
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": bad state"));
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+typename hybrid_vector<T, rv, dv, residency>::const_pointer hybrid_vector<T, rv, dv, residency>::locate(size_type n,
+		size_type& first, size_type& last) const
+{
+	check_consistency();
+	// the spilling source is still in ram
+	count_access(current() == ram || current() == spilling || (current() == split && n >= rv_base));
+	switch (current()) {
+	case ram:
+		return locate_in<const_pointer>(static_cast<const rv&>(*p_rv), 0, size_, n, first, last);
+	case disk: {
+		flush_appends();
+		++epoch;
+		const_pointer p = locate_in<const_pointer>(static_cast<const dv&>(*p_dv), 0, size_, n, first, last);
+		read_ahead(last, size_);
+		return p;
+	}
+	case spilling:
+		if (n >= rv_base)
+			return locate_in<const_pointer>(static_cast<const rv&>(*p_rv), rv_base, size_, n, first, last);
+		return locate_in<const_pointer>(static_cast<const rv&>(*p_spill->source), 0, rv_base, n, first, last);
+	case split: {
+		if (n >= rv_base)
+			return locate_in<const_pointer>(static_cast<const rv&>(*p_rv), rv_base, size_, n, first, last);
+		++epoch;
+		const_pointer p = locate_in<const_pointer>(static_cast<const dv&>(*p_dv), 0, rv_base, n, first, last);
+		read_ahead(last, rv_base);
+		return p;
+	}
+	default:
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": bad state"));
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::advise(size_type first, size_type last, hybrid_vector_access how)
+{
+	check_consistency();
+	BOOST_ASSERT(first <= last && last <= size_);
+	if (how != hybrid_vector_willneed && how != hybrid_vector_dontneed) {
+		access = how;
+		read_ahead_to = 0;
+	}
+	// a spilling disk container belongs to the spill thread
+	if (current() != disk && current() != split)
+		return;
+	last = std::min<size_type>(last, current() == disk ? p_dv->size() : rv_base);
+	if (first < last)
+		hybrid_vector_advice_traits<dv>::advise(*p_dv, first, last, how);
 }
 
-template <typename T, typename rv, typename dv>
-void hybrid_vector<T, rv, dv>::check_consistency()
+template <typename T, typename rv, typename dv, typename residency>
+typename hybrid_vector<T, rv, dv, residency>::snapshot_type hybrid_vector<T, rv, dv, residency>::snapshot() const
+{
+	check_consistency();
+	snapshot_type s;
+	s.size_ = size_;
+	switch (current()) {
+	case ram:
+		s.ram.reset(new rv(*p_rv));
+		break;
+	case spilling: {
+		// the spill thread only reads the source, and so may we
+		rv* r = new rv(*p_spill->source);
+		s.ram.reset(r);
+		hybrid_vector_append_segments(*r, p_rv->begin(), p_rv->size());
+		break;
+	}
+	case split:
+		s.disk.reset(hybrid_vector_snapshot_traits<dv>::freeze(*p_dv, rv_base));
+		s.disk_size = rv_base;
+		s.ram.reset(new rv(*p_rv));
+		break;
+	case disk:
+		flush_appends();
+		s.disk.reset(hybrid_vector_snapshot_traits<dv>::freeze(*p_dv, size_));
+		s.disk_size = size_;
+		break;
+	default:
+		;
+	}
+	return s;
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+template <typename Source>
+void hybrid_vector<T, rv, dv, residency>::import_elements(Source& src, size_type count)
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	check_consistency();
+	if (!count)
+		return;
+	if (state == spilling && p_spill->done)
+		finish_spill();
+	const size_type old = size_;
+	rebalance(old + count);
+	if (current() == ram) {
+		rv_resize(old + count);
+		size_ = old + count;
+		try {
+			rv_for_each_segment(old, size_, hybrid_vector_detail::segment_importer<Source>(src));
+		} catch (...) {
+			resize(old);
+			throw;
+		}
+		return;
+	}
+	if (current() == disk) {
+		flush_appends();
+		if (src.append_to(*p_dv, count)) {
+			++epoch;
+			size_ = old + count;
+			return;
+		}
+	}
+	const size_type chunk = std::min(count, io_chunk());
+	hybrid_vector_detail::io_buffer<T> buf0(chunk), buf1(chunk);
+	T* const buf[2] = { buf0.get(), buf1.get() };
+	hybrid_vector_thread_pool& pool = hybrid_vector_thread_pool::global();
+	try {
+		src.read(reinterpret_cast<char*>(buf[0]), chunk * sizeof(T));
+		for (size_type done = 0, b = 0; done < count; ++b) {
+			const size_type n = std::min(chunk, count - done);
+			const size_type next = std::min(chunk, count - done - n);
+			if (next) {
+				hybrid_vector_detail::read_task<Source> task = {
+					&src, reinterpret_cast<char*>(buf[(b + 1) % 2]), next * sizeof(T) };
+				pool.start(1, task);
+			}
+			try {
+				append_placed(buf[b % 2], buf[b % 2] + n);
+			} catch (...) {
+				if (next) {
+					try {
+						pool.wait();
+					} catch (...) { }
+				}
+				throw;
+			}
+			if (next)
+				pool.wait();
+			done += n;
+		}
+	} catch (...) {
+		resize(old);
+		throw;
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+template <typename Sink>
+void hybrid_vector<T, rv, dv, residency>::export_elements(Sink& sink, size_type first, size_type last) const
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	check_consistency();
+	BOOST_ASSERT(first <= last && last <= size_);
+	if (current() == ram) {
+		rv_for_each_segment(first, last, hybrid_vector_detail::segment_exporter<Sink>(sink));
+		return;
+	}
+	// a spilling disk container belongs to the spill thread
+	if (current() == disk || current() == split) {
+		flush_appends();
+		const size_type on_disk = std::min(last, disk_elements());
+		if (first < on_disk && sink.write_from(*p_dv, first, on_disk)) {
+			++epoch;
+			first = on_disk;
+		}
+	}
+	if (first == last)
+		return;
+	const size_type chunk = std::min(last - first, io_chunk());
+	hybrid_vector_detail::io_buffer<T> buf0(chunk), buf1(chunk);
+	T* const buf[2] = { buf0.get(), buf1.get() };
+	hybrid_vector_thread_pool& pool = hybrid_vector_thread_pool::global();
+	for_each_segment(first, first + chunk, hybrid_vector_detail::segment_gatherer<T>(buf[0]));
+	for (size_type b = 0; first < last; ++b) {
+		const size_type n = std::min(chunk, last - first);
+		hybrid_vector_detail::write_task<Sink> task = {
+			&sink, reinterpret_cast<const char*>(buf[b % 2]), n * sizeof(T) };
+		pool.start(1, task);
+		const size_type next = std::min(chunk, last - first - n);
+		try {
+			if (next)
+				for_each_segment(first + n, first + n + next,
+						hybrid_vector_detail::segment_gatherer<T>(buf[(b + 1) % 2]));
+		} catch (...) {
+			try {
+				pool.wait();
+			} catch (...) { }
+			throw;
+		}
+		pool.wait();
+		first += n;
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::check_consistency() const
 {
 #ifndef NDEBUG
+	if (state == spilling) {
+		BOOST_ASSERT(p_rv.get() != 0 && p_dv.get() != 0 && p_spill.get() != 0);
+		return;
+	}
+	BOOST_ASSERT(p_spill.get() == 0);
+	if (state == split) {
+		BOOST_ASSERT(p_rv.get() != 0 && p_dv.get() != 0);
+		BOOST_ASSERT(rv_base == p_dv->size() && rv_base + p_rv->size() == size_);
+		return;
+	}
 	BOOST_ASSERT((state == ram) ^ (state == disk));
 	// get the state via slow method
 	bool active_ram = p_rv.get() != 0;
@@ -460,58 +1780,440 @@ void hybrid_vector<T, rv, dv>::check_consistency()
 #endif
 }
 
-template <typename T, typename rv, typename dv>
-void hybrid_vector<T, rv, dv>::swap_containers(signed char direction)
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::swap_containers(signed char direction)
 {
 	if (force_ram || force_disk) // should we even bother?
 		return;
 	check_consistency();
-	if (state == ram && direction > 0) { // ram->disk
+	if (direction > 0 ? state != ram : state == ram || state == uninit)
+		return;
+	++epoch;
+	const size_type on_disk = disk_elements();
+	migration_token m = begin_migration(direction, size_, real_size(size_) + payload);
+	if (state == ram && direction > 0 && policy.tail_size) {
+		start_split();
+	} else if (state == ram && direction > 0 && async && !p_rv->empty()) {
+		start_spill(m);
+	} else if (state == spilling && direction < 0) {
+		cancel_spill(1);
+	} else if (state == split && direction < 0) { // split->ram
+		boost::scoped_ptr<rv> whole(new rv(alloc));
+		whole->reserve(size_);
+		load_disk(*whole, block_migration());
+		whole->insert(whole->end(), HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()),
+				HYBRID_VECTOR_MOVE_ITERATOR(p_rv->end()));
+		p_rv.swap(whole);
+		p_dv.reset();
+		rv_base = 0;
+		state = ram;
+	} else if (state == ram && direction > 0) { // ram->disk
 		p_dv.reset(new dv);
-		dv_assign(p_rv->begin(), p_rv->end());
+		store_ram(block_migration());
 		p_rv.reset();
 		state = disk;
-	} else if (state == disk && direction < 0) { // disk->ram
-		p_rv.reset(new rv);
-		rv_assign(p_dv->begin(), p_dv->end());
+	} else { // disk->ram
+		flush_appends();
+		p_rv.reset(new rv(alloc));
+		load_disk(*p_rv, block_migration());
 		p_dv.reset();
 		state = ram;
 	}
+	last_swap = boost::chrono::steady_clock::now();
+	if (budget)
+		budget->update(this, resident_bytes());
+	// a background spill is recorded when it is done
+	if (state == spilling)
+		return;
+	const size_type moved = std::max(on_disk, disk_elements()) - std::min(on_disk, disk_elements());
+	end_migration(m, moved, real_size(moved) + (size_ ? payload / size_ * moved : 0));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::store_ram(boost::true_type)
+{
+	const size_type n = p_rv->size();
+	if (!n)
+		return;
+	const T* in = &(*p_rv)[0];
+	// a contiguous container copies it in one go, without filling it first
+	if (hybrid_vector_segment_traits<dv>::segment_size == 0) {
+		dv_assign(in, in + n);
+		return;
+	}
+	p_dv->resize(n);
+	for (size_type i = 0; i < n; i += io_chunk()) {
+		const size_type j = std::min(n, i + io_chunk());
+		hybrid_vector_for_each_segment<pointer>(*p_dv, i, j,
+				hybrid_vector_detail::segment_scatterer<T>(in + i));
+		hybrid_vector_advice_traits<dv>::advise(*p_dv, i, j, hybrid_vector_dontneed);
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::store_ram(boost::false_type)
+{
+	dv_assign(HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()), HYBRID_VECTOR_MOVE_ITERATOR(p_rv->end()));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::load_disk(rv& out, boost::true_type)
+{
+	const dv& d = *p_dv;
+	const size_type n = d.size();
+	if (!n)
+		return;
+	// sized once: nothing is staged on the way
+	const size_type base = out.size();
+	out.resize(base + n);
+	T* dest = &out[base];
+	hybrid_vector_advice_traits<dv>::advise(d, 0, n, hybrid_vector_sequential);
+	for (size_type i = 0; i < n; i += io_chunk()) {
+		const size_type j = std::min(n, i + io_chunk());
+		hybrid_vector_for_each_segment<const_pointer>(d, i, j,
+				hybrid_vector_detail::segment_gatherer<T>(dest + i));
+		hybrid_vector_advice_traits<dv>::advise(d, i, j, hybrid_vector_dontneed);
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::load_disk(rv& out, boost::false_type)
+{
+	out.insert(out.end(), HYBRID_VECTOR_MOVE_ITERATOR(p_dv->begin()),
+			HYBRID_VECTOR_MOVE_ITERATOR(p_dv->end()));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::rebalance(size_type n)
+{
+	++epoch;
+	n = std::max(n, planned);
+	if (residency::fixed_state) {
+		// only the budget needs to hear about it
+		if (budget && state == ram)
+			budget_admits(n);
+		return;
+	}
+	// follow changes to tail_size; neither moves the elements already on disk
+	if (state == disk && policy.tail_size && !force_disk) {
+		flush_appends();
+		p_rv.reset(new rv(alloc));
+		rv_base = size_;
+		state = split;
+	} else if (state == split && (!policy.tail_size || force_disk)) {
+		end_split();
+	}
+	signed char direction = 0;
+	if (state == ram) {
+		if (policy.wants_disk(footprint(n)))
+			direction = 1;
+	} else if (policy.wants_ram(footprint(n))) {
+		direction = -1;
+	}
+	bool vetoed = force_ram || force_disk;
+	if (!vetoed && policy.min_dwell > 0) {
+		boost::chrono::duration<double> dwell = boost::chrono::steady_clock::now() - last_swap;
+		vetoed = dwell.count() < policy.min_dwell;
+	}
+	// the budget books bytes only for a vector which is staying in, or
+	// coming back to, ram
+	if (state == ram) {
+		if (!direction && !budget_admits(n))
+			direction = 1;
+		if (direction && vetoed) {
+			if (budget)
+				budget->update(this, ram_bytes_after(n));
+			return;
+		}
+	}
+	if (!direction || vetoed)
+		return;
+	if (direction < 0 && !budget_readmits(n))
+		return;
+	swap_containers(direction);
+	if (budget && state == ram)
+		budget->update(this, ram_bytes_after(n));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+bool hybrid_vector<T, rv, dv, residency>::budget_admits(size_type n)
+{
+	if (!budget)
+		return 1;
+	size_type bytes = ram_bytes_after(n);
+	if (force_ram) {
+		if (bytes > resident)
+			budget->update(this, bytes);
+		return 1;
+	}
+	if (evict.exchange(0))
+		return 0;
+	return bytes <= resident || budget->admit(this, bytes, 1);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+bool hybrid_vector<T, rv, dv, residency>::budget_readmits(size_type n)
+{
+	if (!budget)
+		return 1;
+	evict = 0;
+	// nothing was freed since we last asked
+	if (budget->get_generation() == seen_generation)
+		return 0;
+	return budget->admit(this, real_size(n) + payload, 0);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::start_split()
+{
+	p_dv.reset(new dv);
+	rv_base = 0;
+	state = split;
+	trim_tail();
+	// the ram container was sized for the whole vector
+	if (p_rv->capacity() > 2 * (p_rv->size() + tail_chunk()))
+		rv(HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()), HYBRID_VECTOR_MOVE_ITERATOR(p_rv->end()),
+				alloc).swap(*p_rv);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::trim_tail()
+{
+	const size_type chunk = tail_chunk();
+	size_type keep = tail_elements();
+	if (p_rv->size() < keep + chunk)
+		return;
+	// end the disk part on a chunk boundary
+	size_type end = (rv_base + p_rv->size() - keep) / chunk * chunk;
+	if (end > rv_base)
+		flush_tail(std::min<size_type>(end - rv_base, p_rv->size()));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::flush_tail(size_type n)
+{
+	typename rv::iterator mid = p_rv->begin() + n;
+	dv_bulk_append(HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()), HYBRID_VECTOR_MOVE_ITERATOR(mid));
+	p_rv->erase(p_rv->begin(), mid);
+	rv_base += n;
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+template <typename Filler>
+void hybrid_vector<T, rv, dv, residency>::insert_at(size_type pos, size_type n, Filler fill, size_type heap)
+{
+	check_consistency();
+	BOOST_ASSERT(pos <= size_);
+	if (!n)
+		return;
+	payload += heap;
+	rebalance(size_ + n);
+	finish_spill();
+	if (state == split && pos < rv_base)
+		end_split();
+	++epoch;
+	switch (state) {
+	case ram:
+		p_rv->insert(p_rv->begin() + pos, n, T());
+		rv_for_each_segment(pos, pos + n, fill);
+		break;
+	case split:
+		p_rv->insert(p_rv->begin() + (pos - rv_base), n, T());
+		rv_for_each_segment(pos - rv_base, pos - rv_base + n, fill);
+		break;
+	case disk: {
+		flush_appends();
+		size_type old = p_dv->size();
+		p_dv->resize(old + n);
+		dv_move(pos, old, pos + n);
+		hybrid_vector_for_each_segment<pointer>(*p_dv, pos, pos + n, fill);
+		break;
+	}
+	default:
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": bad state"));
+	}
+	size_ += n;
+	if (state == split)
+		trim_tail();
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::erase_at(size_type first, size_type last)
+{
+	check_consistency();
+	BOOST_ASSERT(first <= last && last <= size_);
+	if (first == last)
+		return;
+	finish_spill();
+	if (estimator::has_heap)
+		payload -= payload_of(first, last);
+	if (state == split && first < rv_base)
+		end_split();
+	++epoch;
+	switch (state) {
+	case ram:
+		p_rv->erase(p_rv->begin() + first, p_rv->begin() + last);
+		break;
+	case split:
+		p_rv->erase(p_rv->begin() + (first - rv_base), p_rv->begin() + (last - rv_base));
+		break;
+	case disk: {
+		flush_appends();
+		size_type old = p_dv->size();
+		dv_move(last, old, first);
+		p_dv->resize(old - (last - first));
+		break;
+	}
+	default:
+		throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": bad state"));
+	}
+	size_ -= last - first;
+	rebalance(size_);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::dv_move(size_type first, size_type last, size_type dest)
+{
+	typedef std::vector<T> buffer;
+	const size_type chunk = flush_chunk();
+	buffer buf;
+	buf.reserve(std::min(chunk, last - first));
+	for (size_type done = 0; done < last - first; ) {
+		size_type k = std::min(chunk, last - first - done);
+		// backwards when moving up, so that no element is overwritten unread
+		size_type from = dest > first ? last - done - k : first + done;
+		buf.clear();
+		hybrid_vector_for_each_segment<const_pointer>(static_cast<const dv&>(*p_dv), from, from + k,
+				hybrid_vector_segment_appender<buffer>(buf));
+		hybrid_vector_for_each_segment<pointer>(*p_dv, from - first + dest, from - first + dest + k,
+				hybrid_vector_make_segment_filler(HYBRID_VECTOR_MOVE_ITERATOR(buf.begin())));
+		done += k;
+	}
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::end_split()
+{
+	flush_tail(p_rv->size());
+	p_rv.reset();
+	rv_base = 0;
+	state = disk;
+	if (budget)
+		budget->update(this, 0);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::start_spill(migration_token& m)
+{
+	boost::scoped_ptr<spill_job> job(new spill_job(m));
+	p_dv.reset(new dv);
+	job->dest = p_dv.get();
+	job->source.swap(p_rv);
+	p_rv.reset(new rv(alloc));
+	rv_base = job->source->size();
+	p_spill.swap(job);
+	state = spilling;
+	p_spill->worker.reset(new boost::thread(boost::bind(&spill_job::run, p_spill.get())));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::spill_job::run()
+{
+	const size_type chunk = flush_chunk();
+	const size_type n = source->size();
+	try {
+		dest->reserve(n);
+		for (size_type i = 0; i < n && !cancel; i += chunk)
+			hybrid_vector_append_segments(*dest, source->begin() + i, std::min(n, i + chunk) - i);
+	} catch (...) {
+		error = boost::current_exception();
+	}
+	done = 1;
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::finish_spill()
+{
+	if (state != spilling)
+		return;
+	++epoch;
+	p_spill->join();
+	if (p_spill->error) {
+		boost::exception_ptr error = p_spill->error;
+		cancel_spill(1);
+		boost::rethrow_exception(error);
+	}
+	dv_bulk_append(HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()), HYBRID_VECTOR_MOVE_ITERATOR(p_rv->end()));
+	p_rv.reset();
+	const size_type moved = rv_base;
+	boost::scoped_ptr<spill_job> job;
+	job.swap(p_spill);
+	rv_base = 0;
+	state = disk;
+	if (budget)
+		budget->update(this, 0);
+	end_migration(job->migration, moved, real_size(moved) + (size_ ? payload / size_ * moved : 0));
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_vector<T, rv, dv, residency>::cancel_spill(bool keep)
+{
+	if (state != spilling)
+		return;
+	++epoch;
+	p_spill->cancel = 1;
+	p_spill->join();
+	// nothing ended up on disk
+	end_migration(p_spill->migration, 0, 0);
+	if (keep) {
+		rv& source = *p_spill->source;
+		source.insert(source.end(), HYBRID_VECTOR_MOVE_ITERATOR(p_rv->begin()),
+				HYBRID_VECTOR_MOVE_ITERATOR(p_rv->end()));
+		p_rv.swap(p_spill->source);
+	} else {
+		p_rv->clear();
+	}
+	p_spill.reset();
+	p_dv.reset();
+	rv_base = 0;
+	state = ram;
+	if (budget)
+		budget->update(this, resident_bytes());
 }
 
-template <typename T, typename rv, typename dv>
-inline bool operator == (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator == (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return (v1.size() == v2.size()) && std::equal(v1.begin(), v1.end(), v2.begin());
 }
 
-template <typename T, typename rv, typename dv>
-inline bool operator != (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator != (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return !(v1 == v2);
 }
 
-template <typename T, typename rv, typename dv>
-inline bool operator < (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator < (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return std::lexicographical_compare(v1.begin(), v1.end(), v2.begin(), v2.end());
 }
 
-template <typename T, typename rv, typename dv>
-inline bool operator > (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator > (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return v2 < v1;
 }
 
-template <typename T, typename rv, typename dv>
-inline bool operator <= (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator <= (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return !(v2 < v1);
 } 
 
-template <typename T, typename rv, typename dv>
-inline bool operator >= (const hybrid_vector<T, rv, dv>& v1, const hybrid_vector<T, rv, dv>& v2) {
+template <typename T, typename rv, typename dv, typename residency>
+inline bool operator >= (const hybrid_vector<T, rv, dv, residency>& v1, const hybrid_vector<T, rv, dv, residency>& v2) {
 	return !(v1 < v2);
 }
 
 namespace std {
-	template <typename T, typename rv, typename dv>
-	void swap(hybrid_vector<T, rv, dv>& v1, hybrid_vector<T, rv, dv>& v2) {
+	template <typename T, typename rv, typename dv, typename residency>
+	void swap(hybrid_vector<T, rv, dv, residency>& v1, hybrid_vector<T, rv, dv, residency>& v2) {
 		v1.swap(v2);
 	}
 }
@@ -20,16 +20,16 @@
 
 #include <hybrid_vector/fwd.h>
 
-template <typename T, typename rv, typename dv>
+template <typename T, typename rv, typename dv, typename residency>
 class hybrid_vector_iterator
 {
-	typedef hybrid_vector_iterator<T, rv, dv> this_type;
-	friend class hybrid_vector_const_iterator<T, rv, dv>;
+	typedef hybrid_vector_iterator<T, rv, dv, residency> this_type;
+	friend class hybrid_vector_const_iterator<T, rv, dv, residency>;
 public:
-	typedef hybrid_vector_const_iterator<T, rv, dv> const_iterator;
+	typedef hybrid_vector_const_iterator<T, rv, dv, residency> const_iterator;
 	typedef this_type iterator;
-	typedef hybrid_vector<T, rv, dv> vector_type;
-	friend class hybrid_vector<T, rv, dv>;
+	typedef hybrid_vector<T, rv, dv, residency> vector_type;
+	friend class hybrid_vector<T, rv, dv, residency>;
 
 	typedef std::random_access_iterator_tag iterator_category;
 	typedef typename vector_type::size_type size_type;
@@ -44,14 +44,29 @@ protected:
 	vector_type* parent;
 	size_type off;
 
+	/* The contiguous run [win_first, win_last) of the parent last looked up,
+	 * starting at win. It is valid while the parent's epoch is win_epoch, so
+	 * stepping within it is plain pointer arithmetic.
+	 */
+	mutable pointer win;
+	mutable size_type win_first;
+	mutable size_type win_last;
+	mutable size_type win_epoch;
+
+	reference at(size_type n) const {
+		if (n - win_first >= win_last - win_first || win_epoch != parent->epoch) {
+			win = parent->locate(n, win_first, win_last);
+			win_epoch = parent->epoch;
+		}
+		return win[n - win_first];
+	}
+
 private:
 	hybrid_vector_iterator(vector_type* parent_, size_type off_) :
-		parent(parent_), off(off_) { }
+		parent(parent_), off(off_), win(0), win_first(0), win_last(0), win_epoch(0) { }
 public:
 	hybrid_vector_iterator() :
-		parent(0), off(0) { }
-	hybrid_vector_iterator(const iterator& it) :
-		parent(it.parent), off(it.off) { }
+		parent(0), off(0), win(0), win_first(0), win_last(0), win_epoch(0) { }
 
 	difference_type operator - (const iterator& it) const {
 		return off - it.off;
@@ -61,11 +76,15 @@ public:
 	}
 
 	this_type operator - (size_type n) const {
-		return this_type(parent, off - n);
+		this_type tmp = *this;
+		tmp.off -= n;
+		return tmp;
 	}
 
 	this_type operator + (size_type n) const {
-		return this_type(parent, off + n);
+		this_type tmp = *this;
+		tmp.off += n;
+		return tmp;
 	}
 
 	this_type& operator -= (size_type n) {
@@ -78,32 +97,23 @@ public:
 		return *this;
 	}
 
-	reference operator * () {
-		return (*parent)[off];
-	}
-	const_reference operator * () const {
-		return (*parent)[off];
+	reference operator * () const {
+		return at(off);
 	}
 
-	pointer operator -> () {
-		return &((*parent)[off]);
-	}
-	const_pointer operator -> () const {
-		return &((*parent)[off]);
+	pointer operator -> () const {
+		return &at(off);
 	}
 
-	reference operator [] (size_type n) {
-		return (*parent)[off + n];
-	}
-	const_reference operator [] (size_type n) const {
-		return (*parent)[off + n];
+	reference operator [] (size_type n) const {
+		return at(off + n);
 	}
 
 	this_type& operator ++ () {
 		++off;
 		return *this;
 	}
-	this_type& operator ++ (int) {
+	this_type operator ++ (int) {
 		this_type tmp = *this;
 		++off;
 		return tmp;
@@ -113,7 +123,7 @@ public:
 		--off;
 		return *this;
 	}
-	this_type& operator -- (int) {
+	this_type operator -- (int) {
 		this_type tmp = *this;
 		--off;
 		return tmp;
@@ -133,7 +143,7 @@ public:
 		return off != it.off;
 	}
 	bool operator != (const const_iterator& it) const {
-		BOOSST_ASSERT(parent == it.parent);
+		BOOST_ASSERT(parent == it.parent);
 		return off != it.off;
 	}
 
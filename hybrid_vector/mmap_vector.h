@@ -0,0 +1,589 @@
+/* hybrid_vector/mmap_vector.h - memory-mapped file vector
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_MMAP_VECTOR_H
+#define HYBRID_VECTOR_MMAP_VECTOR_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <boost/current_function.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/has_trivial_copy.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <hybrid_vector/advice.h>
+#include <hybrid_vector/bulk_io.h>
+#include <hybrid_vector/c99int.h>
+#include <hybrid_vector/persist.h>
+#include <hybrid_vector/segment.h>
+#include <hybrid_vector/snapshot.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HYBRID_VECTOR_HAVE_COPY_FILE_RANGE
+#endif
+
+/* A vector of trivially copyable T kept in a memory-mapped temporary file.
+ *
+ * Intended as the disk container of a hybrid_vector:
+ * 	hybrid_vector<T, std::vector<T>, hybrid_vector_mmap_vector<T> >
+ * Element access is a plain pointer dereference into the mapping, so the
+ * kernel page cache does the caching and readahead, and iterators are T*.
+ *
+ * The file is created in $TMPDIR (or /tmp) and unlinked at once, so it
+ * disappears with the vector. Growing the vector may move the mapping;
+ * pointers and iterators are then invalidated as with std::vector.
+ *
+ * A vector can also map elements of an existing file privately (see
+ * hybrid_vector::open); growing it then copies them to a temporary file.
+ * The part of its file which view() has shared is mapped privately in the
+ * same way, so that the vector's writes there no longer reach the view.
+ */
+template <typename T>
+class hybrid_vector_mmap_vector
+{
+	BOOST_STATIC_ASSERT(boost::has_trivial_copy<T>::value);
+	BOOST_STATIC_ASSERT(boost::has_trivial_destructor<T>::value);
+public:
+	typedef T value_type;
+	typedef value_type& reference;
+	typedef const value_type& const_reference;
+	typedef value_type* pointer;
+	typedef const value_type* const_pointer;
+	typedef pointer iterator;
+	typedef const_pointer const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef uint64_t size_type;
+	typedef int64_t difference_type;
+
+private:
+	int fd;
+	pointer data_;
+	size_type size_;
+	size_type capacity_;
+	// length of the mapping in bytes
+	size_type mapped;
+	// set when the mapping is a private view of someone else's file
+	bool borrowed;
+	// bytes at the start of the file shared with views; they are mapped
+	// privately, so the file keeps them as they were
+	mutable size_type frozen;
+
+public:
+	explicit hybrid_vector_mmap_vector(size_type n = 0) :
+			fd(-1), data_(0), size_(0), capacity_(0), mapped(0), borrowed(0), frozen(0) {
+		open_temp();
+		resize(n);
+	}
+
+	hybrid_vector_mmap_vector(const hybrid_vector_mmap_vector& vec) :
+			fd(-1), data_(0), size_(0), capacity_(0), mapped(0), borrowed(0), frozen(0) {
+		open_temp();
+		reserve(vec.size_);
+		if (vec.size_)
+			std::memcpy(data_, vec.data_, vec.size_ * sizeof(T));
+		size_ = vec.size_;
+	}
+
+	// Maps the @param count elements at byte @param offset of @param path;
+	// @param offset must be a multiple of the page size. Throws if the file
+	// is too short to hold them, rather than faulting on their pages later.
+	hybrid_vector_mmap_vector(const std::string& path, uint64_t offset, size_type count,
+	                          hybrid_vector_open_mode mode) :
+			fd(-1), data_(0), size_(count), capacity_(count), mapped(0), borrowed(1), frozen(0) {
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			fail(BOOST_CURRENT_FUNCTION, "open");
+		struct stat st;
+		if (::fstat(fd, &st) != 0) {
+			::close(fd);
+			fail(BOOST_CURRENT_FUNCTION, "fstat");
+		}
+		if (uint64_t(st.st_size) < offset || (uint64_t(st.st_size) - offset) / sizeof(T) < count) {
+			::close(fd);
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": ") + path + " is truncated");
+		}
+		if (!count)
+			return;
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		size_type bytes = (count * sizeof(T) + page - 1) / page * page;
+		int prot = mode == hybrid_vector_read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+		void* p = ::mmap(0, bytes, prot, MAP_PRIVATE, fd, offset);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+		}
+		data_ = static_cast<pointer>(p);
+		mapped = bytes;
+	}
+
+	hybrid_vector_mmap_vector& operator = (const hybrid_vector_mmap_vector& vec) {
+		if (this != &vec) {
+			hybrid_vector_mmap_vector tmp(vec);
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	~hybrid_vector_mmap_vector() {
+		unmap();
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	void swap(hybrid_vector_mmap_vector& vec) {
+		std::swap(fd, vec.fd);
+		std::swap(data_, vec.data_);
+		std::swap(size_, vec.size_);
+		std::swap(capacity_, vec.capacity_);
+		std::swap(mapped, vec.mapped);
+		std::swap(borrowed, vec.borrowed);
+		std::swap(frozen, vec.frozen);
+	}
+
+	bool empty() const {
+		return !size_;
+	}
+	size_type size() const {
+		return size_;
+	}
+	size_type capacity() const {
+		return capacity_;
+	}
+
+	pointer data() {
+		return data_;
+	}
+	const_pointer data() const {
+		return data_;
+	}
+
+	iterator begin() {
+		return data_;
+	}
+	const_iterator begin() const {
+		return data_;
+	}
+	iterator end() {
+		return data_ + size_;
+	}
+	const_iterator end() const {
+		return data_ + size_;
+	}
+
+	reverse_iterator rbegin() {
+		return reverse_iterator(end());
+	}
+	const_reverse_iterator rbegin() const {
+		return const_reverse_iterator(end());
+	}
+	reverse_iterator rend() {
+		return reverse_iterator(begin());
+	}
+	const_reverse_iterator rend() const {
+		return const_reverse_iterator(begin());
+	}
+
+	reference operator [] (size_type n) {
+		return data_[n];
+	}
+	const_reference operator [] (size_type n) const {
+		return data_[n];
+	}
+
+	reference front() {
+		return data_[0];
+	}
+	const_reference front() const {
+		return data_[0];
+	}
+	reference back() {
+		return data_[size_ - 1];
+	}
+	const_reference back() const {
+		return data_[size_ - 1];
+	}
+
+	void reserve(size_type n) {
+		if (n > capacity_)
+			remap(n);
+	}
+
+	void resize(size_type n) {
+		reserve(n);
+		if (n > size_)
+			std::fill(data_ + size_, data_ + n, T());
+		size_ = n;
+	}
+
+	void clear() {
+		size_ = 0;
+	}
+
+	void push_back(const_reference obj) {
+		if (size_ == capacity_) {
+			// obj may live in the mapping we are about to move
+			T tmp(obj);
+			remap(std::max<size_type>(2 * capacity_, page_elements()));
+			data_[size_++] = tmp;
+		} else {
+			data_[size_++] = obj;
+		}
+	}
+
+	void pop_back() {
+		--size_;
+	}
+
+	// Same as stxxl::vector::set_content
+	template <typename InIt>
+	void set_content(InIt _Start, InIt _End, size_type n) {
+		clear();
+		reserve(n);
+		std::copy(_Start, _End, data_);
+		size_ = n;
+	}
+
+	// Gives posix_madvise() @param advice for the pages of the elements [first, last);
+	// advice that cannot be taken is ignored
+	void advise(size_type first, size_type last, int advice) const {
+		last = std::min(last, size_);
+		if (!data_ || first >= last)
+			return;
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		size_type lo = first * sizeof(T) / page * page;
+		size_type hi = last * sizeof(T);
+		::posix_madvise(reinterpret_cast<char*>(data_) + lo, hi - lo, advice);
+	}
+
+	/* Appends @param count elements read from @param src at its offset.
+	 * copy_file_range() copies them into the file in the kernel where it can;
+	 * otherwise, or for what is left, read() puts them in the mapping.
+	 * If the input ends first, this throws and the vector keeps its size.
+	 */
+	void import_from(int src, size_type count) {
+		if (!count)
+			return;
+		reserve(size_ + count);
+		uint64_t offset = size_ * sizeof(T);
+		size_type left = count * sizeof(T);
+#ifdef HYBRID_VECTOR_HAVE_COPY_FILE_RANGE
+		// a borrowed or frozen part of the file is not ours to write, and its
+		// private mapping would not see it
+		while (!borrowed && offset >= frozen && left) {
+			loff_t to = offset;
+			ssize_t k = ::copy_file_range(src, 0, fd, &to, left, 0);
+			if (k < 0 && errno == EINTR)
+				continue;
+			// not between these files, or the end of the input; read() tells which
+			if (k <= 0)
+				break;
+			offset += k;
+			left -= k;
+		}
+#endif
+		hybrid_vector_detail::read_fully(src, reinterpret_cast<char*>(data_) + offset, left);
+		size_ += count;
+	}
+
+	/* Writes the elements [first, last) to @param dest at its offset, with
+	 * sendfile() where it can, else write() from the mapping. A borrowed
+	 * mapping, or the frozen part of one, may differ from its file, so it is
+	 * always written from memory.
+	 */
+	void export_to(int dest, size_type first, size_type last) const {
+		uint64_t offset = first * sizeof(T);
+		size_type left = (last - first) * sizeof(T);
+#ifdef __linux__
+		while (!borrowed && offset >= frozen && left) {
+			off_t from = offset;
+			ssize_t k = ::sendfile(dest, fd, &from, left);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0)
+				break;
+			offset += k;
+			left -= k;
+		}
+#endif
+		hybrid_vector_detail::write_fully(dest, reinterpret_cast<const char*>(data_) + offset, left);
+	}
+
+	/* A read-only vector of the first @param n elements which shares this
+	 * one's file, and so outlives it. Those pages of the file are frozen:
+	 * this vector maps them privately at the same address, so its pointers
+	 * stay valid and a page it overwrites later is copied in memory, leaving
+	 * the file as it was. The file still grows in place as elements are
+	 * appended. Pages this vector has already overwritten below an earlier
+	 * view are copied into the new one; /proc/self/pagemap tells which they
+	 * are, and where it cannot be read, the whole earlier frozen part is.
+	 * A borrowed mapping may differ from its file, so it is copied instead.
+	 */
+	hybrid_vector_mmap_vector* view(size_type n) const {
+		n = std::min(n, size_);
+		if (!borrowed) {
+			size_type old = frozen;
+			freeze(n * sizeof(T));
+			hybrid_vector_mmap_vector* v = new hybrid_vector_mmap_vector(fd, n);
+			if (old && n)
+				copy_written(reinterpret_cast<char*>(v->data_), std::min(old, n * sizeof(T)));
+			if (v->data_)
+				::mprotect(v->data_, v->mapped, PROT_READ);
+			return v;
+		}
+		hybrid_vector_mmap_vector* copy = new hybrid_vector_mmap_vector;
+		try {
+			copy->set_content(data_, data_ + n, n);
+		} catch (...) {
+			delete copy;
+			throw;
+		}
+		return copy;
+	}
+
+private:
+	// Maps the first @param count elements of @param file privately
+	hybrid_vector_mmap_vector(int file, size_type count) :
+			fd(-1), data_(0), size_(count), capacity_(count), mapped(0), borrowed(1), frozen(0) {
+		fd = ::dup(file);
+		if (fd < 0)
+			fail(BOOST_CURRENT_FUNCTION, "dup");
+		if (!count)
+			return;
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		size_type bytes = (count * sizeof(T) + page - 1) / page * page;
+		void* p = ::mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			::close(fd);
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+		}
+		data_ = static_cast<pointer>(p);
+		mapped = bytes;
+	}
+
+	static size_type page_elements() {
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		return std::max<size_type>(page / sizeof(T), 1);
+	}
+
+	static void fail(const char* func, const char* what) {
+		throw std::runtime_error(func + std::string(": ") + what + ": " + std::strerror(errno));
+	}
+
+	void open_temp() {
+		const char* dir = std::getenv("TMPDIR");
+		std::string path = std::string(dir && *dir ? dir : "/tmp") + "/hybrid_vector.XXXXXX";
+		fd = ::mkstemp(&path[0]);
+		if (fd < 0)
+			fail(BOOST_CURRENT_FUNCTION, "mkstemp");
+		::unlink(path.c_str());
+	}
+
+	void unmap() {
+		if (data_)
+			::munmap(data_, mapped);
+		data_ = 0;
+	}
+
+	// Freezes the pages holding the first @param bytes of the file: they are
+	// mapped privately in place, with the data they had while shared
+	void freeze(size_type bytes) const {
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		bytes = std::min(mapped, (bytes + page - 1) / page * page);
+		if (bytes <= frozen)
+			return;
+		if (::mmap(reinterpret_cast<char*>(data_) + frozen, bytes - frozen, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_FIXED, fd, frozen) == MAP_FAILED)
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+		frozen = bytes;
+	}
+
+	/* Copies to @param to the pages among the first @param bytes of the
+	 * mapping which this vector has written since they were frozen, i.e.
+	 * those the kernel has given a copy of their own, present or swapped.
+	 */
+	void copy_written(char* to, size_type bytes) const {
+		const char* from = reinterpret_cast<const char*>(data_);
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		size_type pages = (bytes + page - 1) / page;
+		size_type i = 0;
+#ifdef __linux__
+		int pagemap = ::open("/proc/self/pagemap", O_RDONLY);
+		if (pagemap >= 0) {
+			uint64_t entry[512];
+			while (i < pages) {
+				size_type k = std::min<size_type>(pages - i, 512);
+				off_t at = (reinterpret_cast<uintptr_t>(from) / page + i) * sizeof(uint64_t);
+				if (::pread(pagemap, entry, k * sizeof(uint64_t), at) != ssize_t(k * sizeof(uint64_t)))
+					break;
+				for (size_type j = 0; j < k; ++j, ++i) {
+					bool swapped = entry[j] >> 62 & 1;
+					bool anonymous = (entry[j] >> 63 & 1) && !(entry[j] >> 61 & 1);
+					if (swapped || anonymous)
+						std::memcpy(to + i * page, from + i * page, std::min(page, bytes - i * page));
+				}
+			}
+			::close(pagemap);
+		}
+#endif
+		// without the page table, every page may have been written
+		if (i < pages)
+			std::memcpy(to + i * page, from + i * page, bytes - i * page);
+	}
+
+	// Grows the file and the mapping to hold at least @param n elements
+	void remap(size_type n) {
+		if (borrowed) {
+			unborrow(n);
+			return;
+		}
+		size_type page = ::sysconf(_SC_PAGESIZE);
+		size_type bytes = (n * sizeof(T) + page - 1) / page * page;
+		if (::ftruncate(fd, bytes) != 0)
+			fail(BOOST_CURRENT_FUNCTION, "ftruncate");
+		if (frozen) {
+			remap_frozen(bytes);
+			return;
+		}
+		void* p;
+#ifdef MREMAP_MAYMOVE
+		if (data_)
+			p = ::mremap(data_, mapped, bytes, MREMAP_MAYMOVE);
+		else
+			p = ::mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+#else
+		// a second mapping of the same file sees the same data
+		p = ::mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+		unmap();
+#endif
+		data_ = static_cast<pointer>(p);
+		mapped = bytes;
+		capacity_ = bytes / sizeof(T);
+	}
+
+	/* Grows a mapping with a frozen part to @param bytes without copying:
+	 * the new pages are mapped right after the old ones if that address
+	 * range is free; otherwise the frozen part is moved to the front of a
+	 * new mapping of the file, its own pages and all. Only if that fails too
+	 * are the elements copied to a new temporary file.
+	 */
+	void remap_frozen(size_type bytes) {
+		char* old = reinterpret_cast<char*>(data_);
+		void* p = ::mmap(old + mapped, bytes - mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mapped);
+		if (p == old + mapped) {
+			mapped = bytes;
+			capacity_ = bytes / sizeof(T);
+			return;
+		}
+		if (p != MAP_FAILED)
+			::munmap(p, bytes - mapped);
+#ifdef MREMAP_FIXED
+		p = ::mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			fail(BOOST_CURRENT_FUNCTION, "mmap");
+		// fails if advice has split the frozen part into several mappings
+		if (::mremap(old, frozen, frozen, MREMAP_MAYMOVE | MREMAP_FIXED, p) != MAP_FAILED) {
+			::munmap(old + frozen, mapped - frozen);
+			data_ = static_cast<pointer>(p);
+			mapped = bytes;
+			capacity_ = bytes / sizeof(T);
+			return;
+		}
+		::munmap(p, bytes);
+#endif
+		unborrow(bytes / sizeof(T));
+	}
+
+	// Moves the elements into a new temporary file
+	void unborrow(size_type n) {
+		hybrid_vector_mmap_vector tmp;
+		tmp.reserve(std::max(n, size_));
+		if (size_)
+			std::memcpy(tmp.data_, data_, size_ * sizeof(T));
+		tmp.size_ = size_;
+		swap(tmp);
+	}
+};
+
+template <typename T>
+struct hybrid_vector_file_traits<hybrid_vector_mmap_vector<T> > {
+	static hybrid_vector_mmap_vector<T>* attach(const std::string& path, uint64_t offset,
+	                                            uint64_t count, hybrid_vector_open_mode mode) {
+		return new hybrid_vector_mmap_vector<T>(path, offset, count, mode);
+	}
+};
+
+// The kernel reads ahead on its own; sequential advice makes it read further
+template <typename T>
+struct hybrid_vector_advice_traits<hybrid_vector_mmap_vector<T> > {
+	static void advise(const hybrid_vector_mmap_vector<T>& v, uint64_t first, uint64_t last,
+	                   hybrid_vector_access access) {
+		static const int advice[] = {
+			POSIX_MADV_NORMAL,
+			POSIX_MADV_SEQUENTIAL,
+			POSIX_MADV_RANDOM,
+			POSIX_MADV_WILLNEED,
+			POSIX_MADV_DONTNEED,
+		};
+		v.advise(first, last, advice[access]);
+	}
+	static void prefetch(const hybrid_vector_mmap_vector<T>& v, uint64_t first, uint64_t last) {
+		v.advise(first, last, POSIX_MADV_WILLNEED);
+	}
+};
+
+template <typename T>
+struct hybrid_vector_fd_traits<hybrid_vector_mmap_vector<T> > {
+	static bool append(hybrid_vector_mmap_vector<T>& v, int fd, uint64_t count) {
+		v.import_from(fd, count);
+		return 1;
+	}
+	static bool write(const hybrid_vector_mmap_vector<T>& v, uint64_t first, uint64_t last, int fd) {
+		v.export_to(fd, first, last);
+		return 1;
+	}
+};
+
+// The snapshot maps the vector's file, which the vector stops writing (see view)
+template <typename T>
+struct hybrid_vector_snapshot_traits<hybrid_vector_mmap_vector<T> > {
+	static hybrid_vector_mmap_vector<T>* freeze(const hybrid_vector_mmap_vector<T>& v, uint64_t n) {
+		return v.view(n);
+	}
+};
+
+template <typename T>
+struct hybrid_vector_segment_traits<hybrid_vector_mmap_vector<T> > {
+	enum { segment_size = 0 };
+};
+
+#endif
@@ -0,0 +1,400 @@
+/* hybrid_vector/parallel.h - parallel algorithms over hybrid_vector
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_PARALLEL_H
+#define HYBRID_VECTOR_PARALLEL_H
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <hybrid_vector/c99int.h>
+#include <hybrid_vector/fwd.h>
+#include <hybrid_vector/segment.h>
+#include <hybrid_vector/thread_pool.h>
+
+/* The index space is cut into chunks, whole disk blocks of about 64Ki
+ * elements, which the threads of a hybrid_vector_thread_pool take in turn.
+ *
+ * In ram the threads work on the elements in place. On disk only the calling
+ * thread touches the vector, as the disk container is not thread-safe: it
+ * reads one chunk per thread into a buffer, and while the pool works on that
+ * batch it writes back the previous one and reads the next. Two batches are
+ * buffered at a time.
+ *
+ * Functors are copied for every chunk and may be called concurrently.
+ */
+namespace hybrid_vector_parallel {
+
+namespace detail {
+
+template <typename Vector>
+uint64_t chunk_size()
+{
+	const uint64_t seg = hybrid_vector_segment_traits<Vector>::segment_size;
+	const uint64_t want = uint64_t(1) << 16;
+	return seg ? seg * std::max<uint64_t>(want / seg, 1) : want;
+}
+
+// Segment visitors
+template <typename Func>
+struct apply_each
+{
+	Func f;
+
+	explicit apply_each(Func f_) :
+			f(f_) { }
+
+	template <typename T>
+	void operator () (T* first, T* last) {
+		for (; first != last; ++first)
+			f(*first);
+	}
+};
+
+template <typename Acc, typename Op>
+struct accumulate_each
+{
+	Op op;
+	Acc acc;
+	bool started;
+
+	accumulate_each(Op op_, const Acc& init) :
+			op(op_), acc(init), started(0) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		for (; first != last; ++first) {
+			if (started) {
+				acc = op(acc, *first);
+			} else {
+				acc = *first;
+				started = 1;
+			}
+		}
+	}
+};
+
+template <typename U, typename Op>
+struct transform_each
+{
+	U* out;
+	Op op;
+
+	transform_each(U* out_, Op op_) :
+			out(out_), op(op_) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		for (; first != last; ++first, ++out)
+			*out = op(*first);
+	}
+};
+
+// Fills each run of the destination from the matching elements of src
+template <typename Src, typename Op>
+struct transform_from
+{
+	const Src* src;
+	Op op;
+	uint64_t pos;
+
+	transform_from(const Src& src_, Op op_, uint64_t pos_) :
+			src(&src_), op(op_), pos(pos_) { }
+
+	template <typename U>
+	void operator () (U* first, U* last) {
+		src->for_each_segment(pos, pos + (last - first), transform_each<U, Op>(first, op));
+		pos += last - first;
+	}
+};
+
+// Tasks for vectors in ram: chunk i of the vector itself
+template <typename Vector, typename Func>
+struct for_each_task
+{
+	Vector* v;
+	Func f;
+	uint64_t n, chunk;
+
+	for_each_task(Vector& v_, Func f_, uint64_t chunk_) :
+			v(&v_), f(f_), n(v_.size()), chunk(chunk_) { }
+
+	void operator () (uint64_t i) const {
+		v->for_each_segment(i * chunk, std::min(n, (i + 1) * chunk), apply_each<Func>(f));
+	}
+};
+
+template <typename Vector, typename Acc, typename Op>
+struct reduce_task
+{
+	const Vector* v;
+	Op op;
+	Acc init;
+	Acc* out;
+	uint64_t n, chunk;
+
+	reduce_task(const Vector& v_, Op op_, const Acc& init_, Acc* out_, uint64_t chunk_) :
+			v(&v_), op(op_), init(init_), out(out_), n(v_.size()), chunk(chunk_) { }
+
+	void operator () (uint64_t i) const {
+		out[i] = v->for_each_segment(i * chunk, std::min(n, (i + 1) * chunk),
+				accumulate_each<Acc, Op>(op, init)).acc;
+	}
+};
+
+template <typename Src, typename Dest, typename Op>
+struct transform_task
+{
+	const Src* src;
+	Dest* dest;
+	Op op;
+	uint64_t n, chunk;
+
+	transform_task(const Src& src_, Dest& dest_, Op op_, uint64_t chunk_) :
+			src(&src_), dest(&dest_), op(op_), n(src_.size()), chunk(chunk_) { }
+
+	void operator () (uint64_t i) const {
+		dest->for_each_segment(i * chunk, std::min(n, (i + 1) * chunk),
+				transform_from<Src, Op>(*src, op, i * chunk));
+	}
+};
+
+/* Stages for vectors on disk. read() and write() move the elements
+ * [first, last) between the vector and buffer @param slot; task() returns the
+ * work on that buffer, one call per chunk.
+ */
+template <typename Vector, typename Func>
+struct for_each_stage
+{
+	typedef typename Vector::value_type T;
+
+	struct task_type {
+		T* base;
+		Func f;
+		uint64_t n, chunk;
+
+		void operator () (uint64_t i) const {
+			apply_each<Func> a(f);
+			a(base + i * chunk, base + std::min(n, (i + 1) * chunk));
+		}
+	};
+
+	Vector* v;
+	Func f;
+	uint64_t chunk;
+	std::vector<T> buf[2];
+
+	for_each_stage(Vector& v_, Func f_, uint64_t chunk_) :
+			v(&v_), f(f_), chunk(chunk_) { }
+
+	void read(unsigned slot, uint64_t first, uint64_t last) {
+		buf[slot].clear();
+		static_cast<const Vector&>(*v).for_each_segment(first, last,
+				hybrid_vector_segment_appender<std::vector<T> >(buf[slot]));
+	}
+	task_type task(unsigned slot) {
+		task_type t = { &buf[slot][0], f, buf[slot].size(), chunk };
+		return t;
+	}
+	void write(unsigned slot, uint64_t first, uint64_t last) {
+		v->for_each_segment(first, last,
+				hybrid_vector_segment_filler<typename std::vector<T>::iterator>(buf[slot].begin()));
+	}
+};
+
+template <typename Vector, typename Acc, typename Op>
+struct reduce_stage
+{
+	typedef typename Vector::value_type T;
+
+	struct task_type {
+		const T* base;
+		Op op;
+		Acc init;
+		Acc* out;
+		uint64_t n, chunk;
+
+		void operator () (uint64_t i) const {
+			accumulate_each<Acc, Op> a(op, init);
+			a(base + i * chunk, base + std::min(n, (i + 1) * chunk));
+			out[i] = a.acc;
+		}
+	};
+
+	const Vector* v;
+	Op op;
+	Acc init;
+	uint64_t chunk;
+	std::vector<T> buf[2];
+	std::vector<Acc> part[2];
+	std::vector<Acc> partials;
+
+	reduce_stage(const Vector& v_, Op op_, const Acc& init_, uint64_t chunk_) :
+			v(&v_), op(op_), init(init_), chunk(chunk_) { }
+
+	void read(unsigned slot, uint64_t first, uint64_t last) {
+		buf[slot].clear();
+		v->for_each_segment(first, last, hybrid_vector_segment_appender<std::vector<T> >(buf[slot]));
+	}
+	task_type task(unsigned slot) {
+		part[slot].assign((buf[slot].size() + chunk - 1) / chunk, init);
+		task_type t = { &buf[slot][0], op, init, &part[slot][0], buf[slot].size(), chunk };
+		return t;
+	}
+	void write(unsigned slot, uint64_t, uint64_t) {
+		partials.insert(partials.end(), part[slot].begin(), part[slot].end());
+	}
+};
+
+template <typename Src, typename Dest, typename Op>
+struct transform_stage
+{
+	typedef typename Src::value_type T;
+	typedef typename Dest::value_type U;
+
+	struct task_type {
+		const T* in;
+		U* out;
+		Op op;
+		uint64_t n, chunk;
+
+		void operator () (uint64_t i) const {
+			transform_each<U, Op>(out + i * chunk, op)(in + i * chunk, in + std::min(n, (i + 1) * chunk));
+		}
+	};
+
+	const Src* src;
+	Dest* dest;
+	Op op;
+	uint64_t chunk;
+	std::vector<T> in[2];
+	std::vector<U> out[2];
+
+	transform_stage(const Src& src_, Dest& dest_, Op op_, uint64_t chunk_) :
+			src(&src_), dest(&dest_), op(op_), chunk(chunk_) { }
+
+	void read(unsigned slot, uint64_t first, uint64_t last) {
+		in[slot].clear();
+		src->for_each_segment(first, last, hybrid_vector_segment_appender<std::vector<T> >(in[slot]));
+	}
+	task_type task(unsigned slot) {
+		out[slot].resize(in[slot].size());
+		task_type t = { &in[slot][0], &out[slot][0], op, in[slot].size(), chunk };
+		return t;
+	}
+	void write(unsigned slot, uint64_t first, uint64_t last) {
+		dest->for_each_segment(first, last,
+				hybrid_vector_segment_filler<typename std::vector<U>::iterator>(out[slot].begin()));
+	}
+};
+
+// Runs @param s over [0, n) in batches of one chunk per thread of @param pool
+template <typename Stage>
+void pipeline(Stage& s, uint64_t n, uint64_t chunk, hybrid_vector_thread_pool& pool)
+{
+	const uint64_t batch = chunk * pool.size();
+	const uint64_t batches = (n + batch - 1) / batch;
+	if (!batches)
+		return;
+	s.read(0, 0, std::min(n, batch));
+	for (uint64_t b = 0; b < batches; ++b) {
+		uint64_t first = b * batch, last = std::min(n, first + batch);
+		pool.start((last - first + chunk - 1) / chunk, s.task(b % 2));
+		try {
+			if (b)
+				s.write((b - 1) % 2, first - batch, first);
+			if (b + 1 < batches)
+				s.read((b + 1) % 2, last, std::min(n, last + batch));
+		} catch (...) {
+			// the pool is not free for others until the job is waited for
+			try {
+				pool.wait();
+			} catch (...) { }
+			throw;
+		}
+		pool.wait();
+	}
+	s.write((batches - 1) % 2, (batches - 1) * batch, n);
+}
+
+} // namespace detail
+
+// Calls @param f on every element of @param v
+template <typename T, typename rv, typename dv, typename residency, typename Func>
+void for_each(hybrid_vector<T, rv, dv, residency>& v, Func f,
+              hybrid_vector_thread_pool& pool = hybrid_vector_thread_pool::global())
+{
+	typedef hybrid_vector<T, rv, dv, residency> vector_type;
+	const uint64_t chunk = detail::chunk_size<dv>();
+	if (v.in_ram()) {
+		pool.run((v.size() + chunk - 1) / chunk, detail::for_each_task<vector_type, Func>(v, f, chunk));
+	} else {
+		detail::for_each_stage<vector_type, Func> s(v, f, chunk);
+		detail::pipeline(s, v.size(), chunk, pool);
+	}
+}
+
+// Resizes @param dest to the size of @param src and sets dest[i] = op(src[i])
+template <typename T, typename rv, typename dv, typename residency, typename Dest, typename Op>
+void transform(const hybrid_vector<T, rv, dv, residency>& src, Dest& dest, Op op,
+               hybrid_vector_thread_pool& pool = hybrid_vector_thread_pool::global())
+{
+	typedef hybrid_vector<T, rv, dv, residency> vector_type;
+	const uint64_t chunk = detail::chunk_size<dv>();
+	dest.resize(src.size());
+	if (src.in_ram() && dest.in_ram()) {
+		pool.run((src.size() + chunk - 1) / chunk,
+				detail::transform_task<vector_type, Dest, Op>(src, dest, op, chunk));
+	} else {
+		detail::transform_stage<vector_type, Dest, Op> s(src, dest, op, chunk);
+		detail::pipeline(s, src.size(), chunk, pool);
+	}
+}
+
+/* Combines @param init and the elements of @param v with @param op, which
+ * must be associative and commutative: the elements are combined in
+ * arbitrary groups and order, and init only once.
+ */
+template <typename T, typename rv, typename dv, typename residency, typename Acc, typename Op>
+Acc reduce(const hybrid_vector<T, rv, dv, residency>& v, Acc init, Op op,
+           hybrid_vector_thread_pool& pool = hybrid_vector_thread_pool::global())
+{
+	typedef hybrid_vector<T, rv, dv, residency> vector_type;
+	const uint64_t chunk = detail::chunk_size<dv>();
+	std::vector<Acc> partials;
+	if (v.in_ram()) {
+		partials.assign((v.size() + chunk - 1) / chunk, init);
+		if (!partials.empty())
+			pool.run(partials.size(),
+					detail::reduce_task<vector_type, Acc, Op>(v, op, init, &partials[0], chunk));
+	} else {
+		detail::reduce_stage<vector_type, Acc, Op> s(v, op, init, chunk);
+		detail::pipeline(s, v.size(), chunk, pool);
+		partials.swap(s.partials);
+	}
+	for (typename std::vector<Acc>::iterator it = partials.begin(); it != partials.end(); ++it)
+		init = op(init, *it);
+	return init;
+}
+
+template <typename T, typename rv, typename dv, typename residency, typename Acc>
+Acc reduce(const hybrid_vector<T, rv, dv, residency>& v, Acc init)
+{
+	return reduce(v, init, std::plus<Acc>());
+}
+
+} // namespace hybrid_vector_parallel
+
+#endif
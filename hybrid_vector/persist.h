@@ -0,0 +1,168 @@
+/* hybrid_vector/persist.h - on-disk format for hybrid_vector::save/open
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_PERSIST_H
+#define HYBRID_VECTOR_PERSIST_H
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <boost/current_function.hpp>
+
+#include <hybrid_vector/c99int.h>
+
+enum hybrid_vector_open_mode {
+	// Modifying the elements in place faults; growing copies them first
+	hybrid_vector_read_only,
+	// Changes stay private to the vector and never reach the file
+	hybrid_vector_copy_on_write,
+};
+
+/* File layout: count elements of element_size bytes in native byte order,
+ * followed by this header as a trailer. The elements start at offset 0, so
+ * a disk container may map or adopt the file as it is; the header is found
+ * by the file's length.
+ */
+struct hybrid_vector_file_header
+{
+	enum {
+		current_version = 1,
+		native_byte_order = 0x01020304,
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t element_size;
+	uint64_t count;
+	uint64_t checksum;
+
+	static const char* magic_string() {
+		return "HYBVEC\r\n";
+	}
+
+	hybrid_vector_file_header() {
+		std::memset(this, 0, sizeof(*this));
+	}
+
+	hybrid_vector_file_header(uint64_t element_size_, uint64_t count_, uint64_t checksum_) :
+			version(current_version),
+			byte_order(native_byte_order),
+			element_size(element_size_),
+			count(count_),
+			checksum(checksum_) {
+		std::memcpy(magic, magic_string(), sizeof(magic));
+	}
+
+	// Appends the header after the elements
+	void write(std::ostream& os) const {
+		os.write(reinterpret_cast<const char*>(this), sizeof(*this));
+	}
+
+	// Reads and validates the header of a file for elements of
+	// @param element_size_ bytes, and leaves @param is at the first element
+	void read(std::istream& is, uint64_t element_size_) {
+		is.seekg(0, std::ios::end);
+		std::streamoff length = is.tellg();
+		if (!is || length < std::streamoff(sizeof(*this)))
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": not a hybrid_vector file"));
+		is.seekg(length - sizeof(*this));
+		is.read(reinterpret_cast<char*>(this), sizeof(*this));
+		if (!is || std::memcmp(magic, magic_string(), sizeof(magic)))
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": not a hybrid_vector file"));
+		if (version != current_version)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": unsupported version"));
+		if (byte_order != native_byte_order)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": foreign byte order"));
+		if (element_size != element_size_)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": element size mismatch"));
+		if (uint64_t(length) - sizeof(*this) != count * element_size)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": file length does not match its header"));
+		is.seekg(0);
+	}
+};
+
+/* 64-bit FNV-1a over the raw bytes of the elements, fed one segment at a time.
+ */
+struct hybrid_vector_checksum
+{
+	uint64_t value;
+
+	hybrid_vector_checksum() :
+			value(14695981039346656037ULL) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(first);
+		const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+		for (; p != end; ++p)
+			value = (value ^ *p) * 1099511628211ULL;
+	}
+};
+
+// Segment visitor writing the elements to a stream and checksumming them
+struct hybrid_vector_segment_writer
+{
+	std::ostream* os;
+	hybrid_vector_checksum sum;
+
+	explicit hybrid_vector_segment_writer(std::ostream& os_) :
+			os(&os_) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		sum(first, last);
+		os->write(reinterpret_cast<const char*>(first), (last - first) * sizeof(T));
+	}
+};
+
+// Segment visitor filling the elements from a stream
+struct hybrid_vector_segment_reader
+{
+	std::istream* is;
+
+	explicit hybrid_vector_segment_reader(std::istream& is_) :
+			is(&is_) { }
+
+	template <typename T>
+	void operator () (T* first, T* last) {
+		is->read(reinterpret_cast<char*>(first), (last - first) * sizeof(T));
+		if (!*is)
+			throw std::runtime_error(BOOST_CURRENT_FUNCTION + std::string(": file is truncated"));
+	}
+};
+
+/* How hybrid_vector::open obtains a disk container for a saved file.
+ * attach() returns a new Vector holding the @param count elements stored at
+ * byte @param offset of @param path, or 0 if Vector cannot use the file in
+ * place; the elements are then read into a fresh Vector instead. The bytes
+ * after the elements (the header of a saved file) are not part of them,
+ * and the file must not change under either open mode.
+ *
+ * The default returns 0, so open() reads every element. That includes
+ * stxxl::vector: a vector built on a stxxl::file resizes the file and
+ * writes its blocks back to it, which would cut off the header and
+ * change a file opened read-only or copy-on-write.
+ */
+template <typename Vector>
+struct hybrid_vector_file_traits {
+	static Vector* attach(const std::string& path, uint64_t offset, uint64_t count,
+	                      hybrid_vector_open_mode mode) {
+		(void)path; (void)offset; (void)count; (void)mode;
+		return 0;
+	}
+};
+
+#endif
@@ -16,8 +16,8 @@
 #define HYBRID_VECTOR_PMF_H
 
 template <typename T,
-	  typename dv,
-	  typename rv>
+	  typename rv,
+	  typename dv>
 struct hybrid_vector_pmf {
 	// size_t
 	typedef typename rv::size_type rv_size_type;
@@ -0,0 +1,37 @@
+/* hybrid_vector/residency.h - compile-time residency policies
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_RESIDENCY_H
+#define HYBRID_VECTOR_RESIDENCY_H
+
+/* Which container a hybrid_vector uses, if that is known at compile time.
+ *
+ * fixed_state is 0 if the vector moves between its containers at run time,
+ * as decided by its spill policy and budget. Otherwise it names the only
+ * container ever used (1 for ram, 2 for disk), and every member dispatches on
+ * that constant, so the compiler calls the container directly.
+ */
+struct hybrid_vector_adaptive {
+	static const int fixed_state = 0;
+};
+
+struct hybrid_vector_ram_only {
+	static const int fixed_state = 1;
+};
+
+struct hybrid_vector_disk_only {
+	static const int fixed_state = 2;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/* hybrid_vector/segment.h - contiguous segment traversal
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_SEGMENT_H
+#define HYBRID_VECTOR_SEGMENT_H
+
+#include <algorithm>
+#include <vector>
+
+#include <hybrid_vector/c99int.h>
+
+/* Describes how a vector type lays out its elements in memory.
+ * segment_size is the number of elements in each contiguous run, counted from
+ * index 0; a value of 0 means the whole vector is one contiguous run.
+ *
+ * The default fits stxxl::vector, whose elements are contiguous within a block.
+ * Specialize for other vector types.
+ */
+template <typename Vector>
+struct hybrid_vector_segment_traits {
+	enum { segment_size = Vector::block_type::size };
+};
+
+template <typename T, typename Alloc>
+struct hybrid_vector_segment_traits<std::vector<T, Alloc> > {
+	enum { segment_size = 0 };
+};
+
+template <typename Vector>
+struct hybrid_vector_segment_traits<const Vector> : hybrid_vector_segment_traits<Vector> { };
+
+/* Calls f(p, p + k) for every contiguous run [p, p + k) covering the elements
+ * [first, last) of v. Each pointer is obtained by a single v[i], so for paged
+ * vectors the run is only valid until v is accessed again.
+ */
+template <typename Pointer, typename Vector, typename Func>
+Func hybrid_vector_for_each_segment(Vector& v, uint64_t first, uint64_t last, Func f)
+{
+	const uint64_t seg = hybrid_vector_segment_traits<Vector>::segment_size;
+	while (first < last) {
+		uint64_t end = seg ? std::min<uint64_t>(last, (first / seg + 1) * seg) : last;
+		Pointer p = &v[first];
+		f(p, p + (end - first));
+		first = end;
+	}
+	return f;
+}
+
+// Segment visitor assigning successive elements of an input range
+template <typename InIt>
+struct hybrid_vector_segment_filler
+{
+	InIt it;
+
+	explicit hybrid_vector_segment_filler(InIt it_) :
+			it(it_) { }
+
+	template <typename T>
+	void operator () (T* first, T* last) {
+		for (; first != last; ++first, ++it)
+			*first = *it;
+	}
+};
+
+template <typename InIt>
+hybrid_vector_segment_filler<InIt> hybrid_vector_make_segment_filler(InIt it)
+{
+	return hybrid_vector_segment_filler<InIt>(it);
+}
+
+// Segment visitor appending the elements to a container
+template <typename Container>
+struct hybrid_vector_segment_appender
+{
+	Container* c;
+
+	explicit hybrid_vector_segment_appender(Container& c_) :
+			c(&c_) { }
+
+	template <typename T>
+	void operator () (const T* first, const T* last) {
+		c->insert(c->end(), first, last);
+	}
+};
+
+// Segment visitor assigning one value to every element
+template <typename T>
+struct hybrid_vector_segment_setter
+{
+	const T* value;
+
+	explicit hybrid_vector_segment_setter(const T& value_) :
+			value(&value_) { }
+
+	void operator () (T* first, T* last) {
+		std::fill(first, last, *value);
+	}
+};
+
+/* Appends the @param n elements from @param first to @param v by growing it
+ * once and filling it segment by segment, rather than with one push_back each.
+ */
+template <typename Vector, typename InIt>
+void hybrid_vector_append_segments(Vector& v, InIt first, uint64_t n)
+{
+	uint64_t old = v.size();
+	v.resize(old + n);
+	hybrid_vector_for_each_segment<typename Vector::value_type*>(v, old, old + n,
+			hybrid_vector_segment_filler<InIt>(first));
+}
+
+#endif
@@ -0,0 +1,85 @@
+/* hybrid_vector/size_estimator.h - memory owned by elements
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_SIZE_ESTIMATOR_H
+#define HYBRID_VECTOR_SIZE_ESTIMATOR_H
+
+#include <string>
+#include <vector>
+
+#include <hybrid_vector/c99int.h>
+
+/* The bytes an element owns outside itself, which hybrid_vector adds to
+ * sizeof(T) per element when deciding where its elements go.
+ * has_heap is 0 if no element ever owns any, which turns the accounting off.
+ *
+ * The default fits types which own nothing. Specialize for element types
+ * holding buffers.
+ */
+template <typename T>
+struct hybrid_vector_size_estimator {
+	enum { has_heap = 0 };
+	static uint64_t heap_bytes(const T&) {
+		return 0;
+	}
+};
+
+template <typename C, typename Traits, typename Alloc>
+struct hybrid_vector_size_estimator<std::basic_string<C, Traits, Alloc> > {
+	enum { has_heap = 1 };
+	static uint64_t heap_bytes(const std::basic_string<C, Traits, Alloc>& s) {
+		uint64_t bytes = (s.capacity() + 1) * sizeof(C);
+		// short strings are kept inside the object
+		return bytes > sizeof(s) ? bytes : 0;
+	}
+};
+
+template <typename U, typename Alloc>
+struct hybrid_vector_size_estimator<std::vector<U, Alloc> > {
+	enum { has_heap = 1 };
+	static uint64_t heap_bytes(const std::vector<U, Alloc>& v) {
+		uint64_t bytes = v.capacity() * sizeof(U);
+		if (hybrid_vector_size_estimator<U>::has_heap)
+			for (typename std::vector<U, Alloc>::const_iterator it = v.begin(); it != v.end(); ++it)
+				bytes += hybrid_vector_size_estimator<U>::heap_bytes(*it);
+		return bytes;
+	}
+};
+
+// The heap bytes of the elements [first, last)
+template <typename T, typename FwdIt>
+uint64_t hybrid_vector_heap_bytes(FwdIt first, FwdIt last)
+{
+	uint64_t bytes = 0;
+	if (hybrid_vector_size_estimator<T>::has_heap)
+		for (; first != last; ++first)
+			bytes += hybrid_vector_size_estimator<T>::heap_bytes(*first);
+	return bytes;
+}
+
+// Segment visitor summing the heap bytes of the elements
+template <typename T>
+struct hybrid_vector_heap_counter
+{
+	uint64_t bytes;
+
+	hybrid_vector_heap_counter() :
+			bytes(0) { }
+
+	void operator () (const T* first, const T* last) {
+		bytes += hybrid_vector_heap_bytes<T>(first, last);
+	}
+};
+
+#endif
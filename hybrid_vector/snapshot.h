@@ -0,0 +1,124 @@
+/* hybrid_vector/snapshot.h - read-only views for other threads
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_SNAPSHOT_H
+#define HYBRID_VECTOR_SNAPSHOT_H
+
+#include <algorithm>
+#include <vector>
+#include <boost/assert.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <hybrid_vector/c99int.h>
+#include <hybrid_vector/fwd.h>
+#include <hybrid_vector/segment.h>
+
+/* Makes a disk container holding the first @param n elements of @param v
+ * which no longer depends on v: v may then change, or be destroyed, while
+ * the result is read from another thread.
+ *
+ * The default copies the elements, a segment at a time, so a snapshot of a
+ * vector on disk costs a full pass over its disk part; this is what
+ * stxxl::vector gets. Specialize for vector types which can share them
+ * instead.
+ */
+template <typename Vector>
+struct hybrid_vector_snapshot_traits {
+	static Vector* freeze(const Vector& v, uint64_t n) {
+		typedef typename Vector::value_type T;
+		const uint64_t seg = hybrid_vector_segment_traits<Vector>::segment_size;
+		const uint64_t chunk = seg ? seg : uint64_t(1) << 16;
+		Vector* copy = new Vector;
+		try {
+			copy->reserve(n);
+			std::vector<T> buf;
+			buf.reserve(std::min(chunk, n));
+			for (uint64_t i = 0; i < n; i += chunk) {
+				buf.clear();
+				hybrid_vector_for_each_segment<const T*>(v, i, std::min(n, i + chunk),
+						hybrid_vector_segment_appender<std::vector<T> >(buf));
+				hybrid_vector_append_segments(*copy, buf.begin(), buf.size());
+			}
+		} catch (...) {
+			delete copy;
+			throw;
+		}
+		return copy;
+	}
+};
+
+/* The elements [0, size()) of a hybrid_vector as they were when
+ * hybrid_vector::snapshot() was called.
+ *
+ * The first disk_size elements are in a frozen disk container, the rest in a
+ * ram container of their own. Neither is touched by the vector again, so
+ * the snapshot stays valid whatever the vector does next, and is freed with
+ * its last copy. Copies share the containers; reading them from several
+ * threads at once is safe when const access to the disk container is, which
+ * holds for hybrid_vector_mmap_vector but not for the pager of stxxl::vector.
+ */
+template <typename T, typename rv, typename dv>
+class hybrid_vector_snapshot
+{
+	template <typename, typename, typename, typename>
+	friend class hybrid_vector;
+public:
+	typedef T value_type;
+	typedef const value_type& const_reference;
+	typedef const value_type* const_pointer;
+	typedef uint64_t size_type;
+
+	hybrid_vector_snapshot() :
+			disk_size(0), size_(0) { }
+
+	size_type size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return !size_;
+	}
+
+	const_reference operator [] (size_type n) const {
+		BOOST_ASSERT(n < size_);
+		if (n < disk_size)
+			return static_cast<const dv&>(*disk)[n];
+		return static_cast<const rv&>(*ram)[n - disk_size];
+	}
+
+	// Calls f(p, p + k) for every contiguous run [p, p + k) of the elements [first, last)
+	template <typename Func>
+	Func for_each_segment(size_type first, size_type last, Func f) const {
+		BOOST_ASSERT(first <= last && last <= size_);
+		if (first < disk_size)
+			f = hybrid_vector_for_each_segment<const_pointer>(static_cast<const dv&>(*disk),
+					first, std::min(last, disk_size), f);
+		if (last > disk_size)
+			f = hybrid_vector_for_each_segment<const_pointer>(static_cast<const rv&>(*ram),
+					std::max(first, disk_size) - disk_size, last - disk_size, f);
+		return f;
+	}
+	template <typename Func>
+	Func for_each_segment(Func f) const {
+		return for_each_segment(0, size_, f);
+	}
+
+private:
+	boost::shared_ptr<const dv> disk;
+	size_type disk_size;
+	boost::shared_ptr<const rv> ram;
+	size_type size_;
+};
+
+#endif
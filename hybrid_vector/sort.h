@@ -0,0 +1,253 @@
+/* hybrid_vector/sort.h - parallel and external sorting
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_SORT_H
+#define HYBRID_VECTOR_SORT_H
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <hybrid_vector/c99int.h>
+#include <hybrid_vector/fwd.h>
+#include <hybrid_vector/segment.h>
+
+namespace hybrid_vector_detail {
+
+template <typename RandIt, typename Compare>
+void sort_range(RandIt first, RandIt last, Compare cmp, bool stable, boost::exception_ptr* error)
+{
+	try {
+		if (stable)
+			std::stable_sort(first, last, cmp);
+		else
+			std::sort(first, last, cmp);
+	} catch (...) {
+		*error = boost::current_exception();
+	}
+}
+
+template <typename RandIt, typename Compare>
+void merge_ranges(RandIt first, RandIt middle, RandIt last, Compare cmp, boost::exception_ptr* error)
+{
+	try {
+		std::inplace_merge(first, middle, last, cmp);
+	} catch (...) {
+		*error = boost::current_exception();
+	}
+}
+
+inline void rethrow_first(const std::vector<boost::exception_ptr>& errors)
+{
+	for (std::vector<boost::exception_ptr>::const_iterator it = errors.begin(); it != errors.end(); ++it)
+		if (*it)
+			boost::rethrow_exception(*it);
+}
+
+// A sorted run [pos, end) of a vector, read into buf a segment at a time
+template <typename T>
+struct merge_cursor
+{
+	uint64_t pos;
+	uint64_t end;
+	std::vector<T> buf;
+	typename std::vector<T>::size_type i;
+
+	merge_cursor(uint64_t pos_, uint64_t end_) :
+			pos(pos_), end(end_), i(0) { }
+
+	template <typename Vector>
+	bool fill(const Vector& v, uint64_t n) {
+		buf.clear();
+		i = 0;
+		uint64_t last = std::min(end, pos + n);
+		hybrid_vector_for_each_segment<const T*>(v, pos, last,
+				hybrid_vector_segment_appender<std::vector<T> >(buf));
+		pos = last;
+		return !buf.empty();
+	}
+};
+
+// Heap order on cursor numbers: smallest head on top, earlier run first on ties
+template <typename T, typename Compare>
+struct cursor_after
+{
+	const std::vector<merge_cursor<T> >* cursors;
+	Compare cmp;
+
+	cursor_after(const std::vector<merge_cursor<T> >& cursors_, Compare cmp_) :
+			cursors(&cursors_), cmp(cmp_) { }
+
+	bool operator () (std::size_t a, std::size_t b) const {
+		const T& x = (*cursors)[a].buf[(*cursors)[a].i];
+		const T& y = (*cursors)[b].buf[(*cursors)[b].i];
+		if (cmp(y, x))
+			return 1;
+		if (cmp(x, y))
+			return 0;
+		return a > b;
+	}
+};
+
+/* Merges the sorted runs of @param run elements of @param src into the empty
+ * @param dest, @param fan_in runs at a time, reading and writing @param chunk
+ * elements at a time.
+ */
+template <typename Vector, typename Compare>
+void merge_pass(const Vector& src, Vector& dest, uint64_t run, uint64_t fan_in,
+                uint64_t chunk, Compare cmp)
+{
+	typedef typename Vector::value_type T;
+	const uint64_t n = src.size();
+	std::vector<T> out;
+	out.reserve(chunk);
+	for (uint64_t group = 0; group < n; group += run * fan_in) {
+		std::vector<merge_cursor<T> > cursors;
+		for (uint64_t i = group; i < n && i < group + run * fan_in; i += run)
+			cursors.push_back(merge_cursor<T>(i, std::min(n, i + run)));
+		std::vector<std::size_t> heap;
+		for (std::size_t k = 0; k < cursors.size(); ++k)
+			if (cursors[k].fill(src, chunk))
+				heap.push_back(k);
+		cursor_after<T, Compare> after(cursors, cmp);
+		std::make_heap(heap.begin(), heap.end(), after);
+		while (!heap.empty()) {
+			std::pop_heap(heap.begin(), heap.end(), after);
+			merge_cursor<T>& c = cursors[heap.back()];
+			out.push_back(c.buf[c.i]);
+			if (out.size() == chunk) {
+				hybrid_vector_append_segments(dest, out.begin(), out.size());
+				out.clear();
+			}
+			if (++c.i < c.buf.size() || c.fill(src, chunk))
+				std::push_heap(heap.begin(), heap.end(), after);
+			else
+				heap.pop_back();
+		}
+	}
+	hybrid_vector_append_segments(dest, out.begin(), out.size());
+}
+
+} // namespace hybrid_vector_detail
+
+/* Sorts [first, last) on @param threads threads (default: one per core):
+ * each thread sorts a slice, then the slices are merged pairwise, also in
+ * parallel. With @param stable set, equal elements keep their order.
+ */
+template <typename RandIt, typename Compare>
+void hybrid_vector_parallel_sort(RandIt first, RandIt last, Compare cmp, bool stable = 0,
+                                 unsigned threads = 0)
+{
+	using namespace hybrid_vector_detail;
+	const uint64_t n = last - first;
+	if (!threads)
+		threads = std::max(boost::thread::hardware_concurrency(), 1u);
+	// not worth a thread
+	threads = std::min<uint64_t>(threads, n / (1 << 14) + 1);
+	if (threads < 2) {
+		if (stable)
+			std::stable_sort(first, last, cmp);
+		else
+			std::sort(first, last, cmp);
+		return;
+	}
+	std::vector<RandIt> bounds;
+	for (unsigned i = 0; i <= threads; ++i)
+		bounds.push_back(first + n * i / threads);
+	std::vector<boost::exception_ptr> errors(threads);
+	boost::thread_group group;
+	for (unsigned i = 0; i < threads; ++i)
+		group.create_thread(boost::bind(&sort_range<RandIt, Compare>,
+				bounds[i], bounds[i + 1], cmp, stable, &errors[i]));
+	group.join_all();
+	rethrow_first(errors);
+	for (unsigned width = 1; width < threads; width *= 2) {
+		boost::thread_group merges;
+		for (unsigned i = 0; i + width < threads; i += 2 * width)
+			merges.create_thread(boost::bind(&merge_ranges<RandIt, Compare>, bounds[i],
+					bounds[i + width], bounds[std::min(i + 2 * width, threads)], cmp, &errors[i]));
+		merges.join_all();
+		rethrow_first(errors);
+	}
+}
+
+/* Sorts the elements of @param v, a vector too large for ram, using at most
+ * about @param memory bytes of it.
+ * Runs of that size are read, sorted with hybrid_vector_parallel_sort and
+ * written back in place; they are then merged into a second Vector, as many
+ * at a time as there is memory for one segment of each, and the result is
+ * swapped into @param v. Every pass reads and writes v sequentially.
+ */
+template <typename Vector, typename Compare>
+void hybrid_vector_external_sort(Vector& v, Compare cmp, uint64_t memory, bool stable = 0)
+{
+	using namespace hybrid_vector_detail;
+	typedef typename Vector::value_type T;
+	const uint64_t n = v.size();
+	const uint64_t seg = hybrid_vector_segment_traits<Vector>::segment_size;
+	// room for at least three segments: two runs and the output
+	const uint64_t chunk_hint = seg ? seg : uint64_t(1) << 16;
+	const uint64_t run = std::max<uint64_t>(memory / sizeof(T), 3 * chunk_hint);
+	typedef std::vector<T> buffer;
+	buffer buf;
+	buf.reserve(std::min(run, n));
+	for (uint64_t i = 0; i < n; i += run) {
+		uint64_t j = std::min(n, i + run);
+		buf.clear();
+		hybrid_vector_for_each_segment<const T*>(static_cast<const Vector&>(v), i, j,
+				hybrid_vector_segment_appender<buffer>(buf));
+		hybrid_vector_parallel_sort(buf.begin(), buf.end(), cmp, stable);
+		hybrid_vector_for_each_segment<T*>(v, i, j,
+				hybrid_vector_segment_filler<typename buffer::iterator>(buf.begin()));
+	}
+	buffer().swap(buf);
+	const uint64_t fan_in = std::max<uint64_t>(run / chunk_hint - 1, 2);
+	for (uint64_t width = run; width < n; width *= fan_in) {
+		Vector merged;
+		merged.reserve(n);
+		merge_pass(static_cast<const Vector&>(v), merged, width, fan_in, chunk_hint, cmp);
+		v.swap(merged);
+	}
+}
+
+// Sorts @param v by @param cmp; see hybrid_vector::sort
+template <typename T, typename rv, typename dv, typename residency, typename Compare>
+void hybrid_sort(hybrid_vector<T, rv, dv, residency>& v, Compare cmp, uint64_t memory = 0)
+{
+	v.sort(cmp, 0, memory);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_sort(hybrid_vector<T, rv, dv, residency>& v)
+{
+	v.sort(std::less<T>(), 0, 0);
+}
+
+// As hybrid_sort, keeping equal elements in order
+template <typename T, typename rv, typename dv, typename residency, typename Compare>
+void hybrid_stable_sort(hybrid_vector<T, rv, dv, residency>& v, Compare cmp, uint64_t memory = 0)
+{
+	v.sort(cmp, 1, memory);
+}
+
+template <typename T, typename rv, typename dv, typename residency>
+void hybrid_stable_sort(hybrid_vector<T, rv, dv, residency>& v)
+{
+	v.sort(std::less<T>(), 1, 0);
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* hybrid_vector/spill_policy.h - when to move between containers
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_SPILL_POLICY_H
+#define HYBRID_VECTOR_SPILL_POLICY_H
+
+#include <hybrid_vector/c99int.h>
+
+/* Decides when a hybrid_vector moves between its ram and disk containers.
+ *
+ * The vector spills once its size in bytes reaches spill_size and reloads once
+ * it drops below reload_size. The size counts the ram container's spare
+ * capacity and, through hybrid_vector_size_estimator, what the elements own
+ * on the heap. Keeping reload_size under spill_size leaves a
+ * band in which neither happens, so a size oscillating around one threshold
+ * does not copy the whole vector back and forth.
+ * A migration is also held off until the vector has spent min_dwell seconds
+ * in its current container, and never_reload keeps a spilled vector on disk.
+ *
+ * A nonzero tail_size keeps the most recent tail_size bytes of a spilled
+ * vector in ram: only the prefix before them is on disk, and the oldest part
+ * of the tail is moved there as the vector grows.
+ */
+struct hybrid_vector_spill_policy
+{
+	uint64_t spill_size;
+	uint64_t reload_size;
+	double min_dwell;
+	bool never_reload;
+	uint64_t tail_size;
+
+	// The classic single threshold
+	explicit hybrid_vector_spill_policy(uint64_t swap_size = 128<<20 /* 128 MB */) :
+			spill_size(swap_size),
+			reload_size(swap_size),
+			min_dwell(0),
+			never_reload(0),
+			tail_size(0) { }
+
+	hybrid_vector_spill_policy(uint64_t spill_size_, uint64_t reload_size_,
+	                           double min_dwell_ = 0, bool never_reload_ = 0,
+	                           uint64_t tail_size_ = 0) :
+			spill_size(spill_size_),
+			reload_size(reload_size_),
+			min_dwell(min_dwell_),
+			never_reload(never_reload_),
+			tail_size(tail_size_) { }
+
+	bool wants_disk(uint64_t bytes) const {
+		return bytes >= spill_size;
+	}
+
+	bool wants_ram(uint64_t bytes) const {
+		return !never_reload && bytes < reload_size;
+	}
+};
+
+#endif
@@ -0,0 +1,286 @@
+/* hybrid_vector/stats.h - access and migration statistics
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_STATS_H
+#define HYBRID_VECTOR_STATS_H
+
+/* Statistics are kept only if HYBRID_VECTOR_STATS is defined before
+ * hybrid_vector.h is included. Otherwise hybrid_vector_instrumented is an
+ * empty base whose members do nothing, and neither stats() nor
+ * set_migration_hooks() exist.
+ */
+
+#ifdef HYBRID_VECTOR_STATS
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+#include <hybrid_vector/c99int.h>
+
+// A move of elements between the ram and disk containers
+struct hybrid_vector_migration
+{
+	enum kind_type {
+		spill = 1,	// towards disk
+		reload = -1,	// towards ram
+	} kind;
+	// Before: the size of the vector. After: the elements which changed container.
+	uint64_t elements;
+	uint64_t bytes;
+	// 0 before
+	double seconds;
+
+	hybrid_vector_migration(kind_type kind_, uint64_t elements_, uint64_t bytes_) :
+			kind(kind_), elements(elements_), bytes(bytes_), seconds(0) { }
+};
+
+typedef boost::function<void (const hybrid_vector_migration&)> hybrid_vector_migration_hook;
+
+// Latencies, counted in buckets of powers of two microseconds
+struct hybrid_vector_latency_histogram
+{
+	enum { buckets = 32 };
+	// counts[0]: under 2 us; counts[i]: [2^i, 2^(i+1)) us; the last one is open
+	uint64_t counts[buckets];
+	double total_seconds;
+	double max_seconds;
+
+	hybrid_vector_latency_histogram() :
+			total_seconds(0), max_seconds(0) {
+		for (unsigned i = 0; i < buckets; ++i)
+			counts[i] = 0;
+	}
+
+	void record(double seconds) {
+		uint64_t us = uint64_t(seconds * 1e6);
+		unsigned i = 0;
+		while (i + 1 < buckets && us >= 2) {
+			us >>= 1;
+			++i;
+		}
+		++counts[i];
+		total_seconds += seconds;
+		if (seconds > max_seconds)
+			max_seconds = seconds;
+	}
+
+	hybrid_vector_latency_histogram& operator += (const hybrid_vector_latency_histogram& h) {
+		for (unsigned i = 0; i < buckets; ++i)
+			counts[i] += h.counts[i];
+		total_seconds += h.total_seconds;
+		if (h.max_seconds > max_seconds)
+			max_seconds = h.max_seconds;
+		return *this;
+	}
+};
+
+/* What a hybrid_vector did, or all of them together (see process()).
+ *
+ * Accesses are operator [] calls, and iterator lookups: an iterator counts
+ * once per block (or whole ram container) it moves into, not per element.
+ */
+struct hybrid_vector_stats
+{
+	uint64_t spills;
+	uint64_t reloads;
+	uint64_t elements_spilled;
+	uint64_t elements_reloaded;
+	uint64_t bytes_spilled;
+	uint64_t bytes_reloaded;
+	uint64_t ram_accesses;
+	uint64_t disk_accesses;
+	hybrid_vector_latency_histogram spill_latency;
+	hybrid_vector_latency_histogram reload_latency;
+
+	hybrid_vector_stats() :
+			spills(0), reloads(0), elements_spilled(0), elements_reloaded(0),
+			bytes_spilled(0), bytes_reloaded(0), ram_accesses(0), disk_accesses(0) { }
+
+	void record(const hybrid_vector_migration& m) {
+		if (m.kind == hybrid_vector_migration::spill) {
+			++spills;
+			elements_spilled += m.elements;
+			bytes_spilled += m.bytes;
+			spill_latency.record(m.seconds);
+		} else {
+			++reloads;
+			elements_reloaded += m.elements;
+			bytes_reloaded += m.bytes;
+			reload_latency.record(m.seconds);
+		}
+	}
+
+	hybrid_vector_stats& operator += (const hybrid_vector_stats& s) {
+		spills += s.spills;
+		reloads += s.reloads;
+		elements_spilled += s.elements_spilled;
+		elements_reloaded += s.elements_reloaded;
+		bytes_spilled += s.bytes_spilled;
+		bytes_reloaded += s.bytes_reloaded;
+		ram_accesses += s.ram_accesses;
+		disk_accesses += s.disk_accesses;
+		spill_latency += s.spill_latency;
+		reload_latency += s.reload_latency;
+		return *this;
+	}
+
+	/* The totals of every hybrid_vector in the process.
+	 * Migrations are added as they finish; accesses are added when their
+	 * vector next migrates or is destroyed.
+	 */
+	static hybrid_vector_stats process() {
+		boost::lock_guard<boost::mutex> lock(process_mutex());
+		return process_totals();
+	}
+
+	static void add_to_process(const hybrid_vector_stats& s) {
+		boost::lock_guard<boost::mutex> lock(process_mutex());
+		process_totals() += s;
+	}
+
+private:
+	static hybrid_vector_stats& process_totals() {
+		static hybrid_vector_stats totals;
+		return totals;
+	}
+	static boost::mutex& process_mutex() {
+		static boost::once_flag once = BOOST_ONCE_INIT;
+		boost::call_once(&init_process_mutex, once);
+		return *process_mutex_instance();
+	}
+	static boost::mutex*& process_mutex_instance() {
+		static boost::mutex* m = 0;
+		return m;
+	}
+	static void init_process_mutex() {
+		// never destroyed, so that vectors destroyed at exit can still report
+		process_mutex_instance() = new boost::mutex;
+		process_totals();
+	}
+};
+
+/* The statistics and hooks of one hybrid_vector.
+ * Like the budget registration, they belong to an object, not to its value:
+ * a copy starts from zero, though it gets the hooks, and assignment leaves
+ * both alone. Accesses are counted atomically, since threads may read a
+ * vector at once.
+ */
+class hybrid_vector_instrumented
+{
+public:
+	hybrid_vector_stats stats() const {
+		hybrid_vector_stats s = stats_;
+		s.ram_accesses = ram_accesses.load(boost::memory_order_relaxed);
+		s.disk_accesses = disk_accesses.load(boost::memory_order_relaxed);
+		return s;
+	}
+
+	// Calls @param before_ and @param after_ around every spill and reload
+	void set_migration_hooks(const hybrid_vector_migration_hook& before_,
+	                         const hybrid_vector_migration_hook& after_) {
+		before = before_;
+		after = after_;
+	}
+
+protected:
+	// A migration in progress, timed from its start
+	struct migration_token : hybrid_vector_migration {
+		boost::chrono::steady_clock::time_point start;
+
+		migration_token(kind_type kind_, uint64_t elements_, uint64_t bytes_) :
+				hybrid_vector_migration(kind_, elements_, bytes_) { }
+	};
+
+	hybrid_vector_instrumented() :
+			ram_accesses(0), disk_accesses(0), published_ram(0), published_disk(0) { }
+	hybrid_vector_instrumented(const hybrid_vector_instrumented& i) :
+			ram_accesses(0), disk_accesses(0), published_ram(0), published_disk(0),
+			before(i.before), after(i.after) { }
+	hybrid_vector_instrumented& operator = (const hybrid_vector_instrumented&) {
+		return *this;
+	}
+	~hybrid_vector_instrumented() {
+		hybrid_vector_stats delta;
+		take_accesses(delta);
+		hybrid_vector_stats::add_to_process(delta);
+	}
+
+	void count_access(bool in_ram) const {
+		(in_ram ? ram_accesses : disk_accesses).fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	migration_token begin_migration(signed char direction, uint64_t size, uint64_t bytes) {
+		migration_token m(direction > 0 ? hybrid_vector_migration::spill
+				: hybrid_vector_migration::reload, size, bytes);
+		if (before)
+			before(m);
+		m.start = boost::chrono::steady_clock::now();
+		return m;
+	}
+
+	void end_migration(migration_token& m, uint64_t elements, uint64_t bytes) {
+		m.seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - m.start).count();
+		m.elements = elements;
+		m.bytes = bytes;
+		stats_.record(m);
+		hybrid_vector_stats delta;
+		delta.record(m);
+		take_accesses(delta);
+		hybrid_vector_stats::add_to_process(delta);
+		if (after)
+			after(m);
+	}
+
+private:
+	// Moves the accesses not yet in the process totals into @param delta
+	void take_accesses(hybrid_vector_stats& delta) {
+		uint64_t ram = ram_accesses.load(boost::memory_order_relaxed);
+		uint64_t disk = disk_accesses.load(boost::memory_order_relaxed);
+		delta.ram_accesses = ram - published_ram;
+		delta.disk_accesses = disk - published_disk;
+		published_ram = ram;
+		published_disk = disk;
+	}
+
+	// the migrations; the accesses are counted apart
+	hybrid_vector_stats stats_;
+	mutable boost::atomic<uint64_t> ram_accesses;
+	mutable boost::atomic<uint64_t> disk_accesses;
+	uint64_t published_ram;
+	uint64_t published_disk;
+	hybrid_vector_migration_hook before;
+	hybrid_vector_migration_hook after;
+};
+
+#else // HYBRID_VECTOR_STATS
+
+class hybrid_vector_instrumented
+{
+protected:
+	struct migration_token { };
+
+	void count_access(bool) const { }
+	migration_token begin_migration(signed char, uint64_t, uint64_t) {
+		return migration_token();
+	}
+	void end_migration(migration_token&, uint64_t, uint64_t) { }
+};
+
+#endif // HYBRID_VECTOR_STATS
+
+#endif
@@ -0,0 +1,169 @@
+/* hybrid_vector/thread_pool.h - worker threads for the parallel algorithms
+ *
+ * Author: Andrey Vul
+ * Version: r5
+ *
+ * DO NOT INCLUDE THIS HEADER DIRECTLY!
+ *
+** Copyright (C) 2011, Andrey Vul <andrey@moshbear.net>
+ *
+ * Distributed under the Boost Software License, Version 1.0.
+ * (See accompanying file LICENSE_1_0.txt or copy at
+ * http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef HYBRID_VECTOR_THREAD_POOL_H
+#define HYBRID_VECTOR_THREAD_POOL_H
+
+#include <algorithm>
+#include <boost/assert.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <hybrid_vector/c99int.h>
+
+/* A fixed set of threads running one job at a time.
+ *
+ * A job is task(i) for every i in [0, count). Threads take the next i as
+ * they become free, so uneven tasks balance themselves. The thread that
+ * waits for the job takes part in it, so start() followed by other work and
+ * then wait() overlaps that work with the job.
+ * Threads may share a pool: a start() waits until the job of another thread
+ * has been waited for, so every start() must be followed by a wait() on the
+ * same thread. Tasks must not start jobs on the pool running them.
+ */
+class hybrid_vector_thread_pool : boost::noncopyable
+{
+public:
+	// @param threads defaults to one per core, less the caller's
+	explicit hybrid_vector_thread_pool(unsigned threads = 0) :
+			stop(0), generation(0), busy(0), count(0), next(0) {
+		if (!threads)
+			threads = std::max(boost::thread::hardware_concurrency(), 2u) - 1;
+		for (unsigned i = 0; i < threads; ++i)
+			workers.create_thread(boost::bind(&hybrid_vector_thread_pool::work, this));
+	}
+
+	~hybrid_vector_thread_pool() {
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			stop = 1;
+		}
+		wake.notify_all();
+		workers.join_all();
+	}
+
+	// The process-wide pool
+	static hybrid_vector_thread_pool& global() {
+		static boost::once_flag once = BOOST_ONCE_INIT;
+		boost::call_once(&init_global, once);
+		return *global_instance();
+	}
+
+	// Threads taking part in a job, the waiting one included
+	unsigned size() const {
+		return workers.size() + 1;
+	}
+
+	// Starts a job of @param count_ tasks, once the previous one has been waited for
+	template <typename Task>
+	void start(uint64_t count_, Task task) {
+		// held until wait() returns
+		boost::unique_lock<boost::mutex> job_lock(job_mutex);
+		boost::lock_guard<boost::mutex> lock(mutex);
+		BOOST_ASSERT(!busy);
+		job = task;
+		count = count_;
+		next = 0;
+		error = boost::exception_ptr();
+		busy = workers.size();
+		++generation;
+		wake.notify_all();
+		job_lock.release();
+	}
+
+	// Helps with the job until it is done, then rethrows its first exception
+	void wait() {
+		boost::lock_guard<boost::mutex> job_lock(job_mutex, boost::adopt_lock);
+		help();
+		boost::unique_lock<boost::mutex> lock(mutex);
+		while (busy)
+			done.wait(lock);
+		job.clear();
+		if (error) {
+			boost::exception_ptr e = error;
+			error = boost::exception_ptr();
+			boost::rethrow_exception(e);
+		}
+	}
+
+	template <typename Task>
+	void run(uint64_t count_, Task task) {
+		start(count_, task);
+		wait();
+	}
+
+private:
+	void help() {
+		for (uint64_t i; (i = next++) < count; ) {
+			try {
+				job(i);
+			} catch (...) {
+				boost::lock_guard<boost::mutex> lock(mutex);
+				if (!error)
+					error = boost::current_exception();
+				next = count;
+			}
+		}
+	}
+
+	void work() {
+		uint64_t seen = 0;
+		boost::unique_lock<boost::mutex> lock(mutex);
+		for (;;) {
+			while (!stop && generation == seen)
+				wake.wait(lock);
+			if (stop)
+				return;
+			seen = generation;
+			lock.unlock();
+			help();
+			lock.lock();
+			if (!--busy)
+				done.notify_all();
+		}
+	}
+
+	static hybrid_vector_thread_pool*& global_instance() {
+		static hybrid_vector_thread_pool* p = 0;
+		return p;
+	}
+	static void init_global() {
+		// never destroyed, like hybrid_vector_budget::global()
+		global_instance() = new hybrid_vector_thread_pool;
+	}
+
+	// Owned by the thread whose job is running
+	boost::mutex job_mutex;
+	boost::mutex mutex;
+	boost::condition_variable wake;
+	boost::condition_variable done;
+	boost::thread_group workers;
+	bool stop;
+	uint64_t generation;
+	unsigned busy;
+	boost::function<void (uint64_t)> job;
+	uint64_t count;
+	boost::atomic<uint64_t> next;
+	boost::exception_ptr error;
+};
+
+#endif